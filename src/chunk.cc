@@ -11,13 +11,16 @@
 #include "src/chunk.h"
 #include "src/codesearch.h"
 
-#include "divsufsort.h"
+#include "divsufsort_lines.h"
 #include "re2/re2.h"
 #include <gflags/gflags.h>
 
+#include <atomic>
 #include <limits>
+#include <thread>
 
 DECLARE_bool(index);
+DEFINE_bool(index_line_starts, true, "Index the suffixes that begin a line, to speed up searches anchored with ^.");
 
 void chunk::add_chunk_file(indexed_file *sf, const string_view& line)
 {
@@ -46,9 +49,11 @@ void chunk::add_chunk_file(indexed_file *sf, const string_view& line)
     chunk_files++;
     cur_file.push_back(chunk_file());
     chunk_file& cf = cur_file.back();
-    cf.files.push_front(sf);
+    cf.first = file_ids.size();
+    cf.nfiles = 1;
     cf.left = l;
     cf.right = r;
+    file_ids.push_back(sf->no);
 }
 
 void chunk::finish_file() {
@@ -65,70 +70,223 @@ void chunk::finish_file() {
 
 int chunk::chunk_files = 0;
 
-void chunk::finalize() {
-    if (FLAGS_index) {
+void chunk::finalize(int ways) {
+    if (FLAGS_index && fm.enabled()) {
+        fm.build(data, size);
+    } else if (FLAGS_index && trigrams.enabled()) {
+        trigrams.build(data, size);
+    } else if (FLAGS_index && sparse) {
+        build_sparse_suffixes(ways);
+    } else if (FLAGS_index) {
         // For the purposes of livegrep's line-based sorting, we need
-        // to sort \n before all other characters. divsufsort,
-        // understandably, just lexically-sorts sorts thing. Kludge
-        // around by munging the data in-place before and after the
-        // sort. Sorting must look at all the data anyways, so this is
-        // not an overly-expensive job.
-        std::replace(data, data + size, '\n', '\0');
-        divsufsort(data, reinterpret_cast<saidx_t*>(suffixes), size);
-        std::replace(data, data + size, '\0', '\n');
+        // to sort \n before all other characters. divsufsort_lines()
+        // is divsufsort with newlines ranked lowest as it reads the
+        // data, so the data never has to be rewritten around the sort.
+        divsufsort_lines(data, reinterpret_cast<int*>(suffixes), size, ways);
+        nsuffixes = size;
+        build_buckets();
+        if (FLAGS_index_line_starts)
+            build_line_starts();
     }
 }
 
-void chunk::finalize_files() {
+namespace {
+    // The byte `depth' into the suffix at `pos', ordered as
+    // divsufsort_lines() orders them: newlines (and NULs) first, after
+    // only the end of the data.
+    int suffix_byte(const unsigned char *data, uint32_t size,
+                    uint32_t pos, uint32_t depth) {
+        if (pos + depth >= size)
+            return -1;
+        unsigned char c = data[pos + depth];
+        return c == '\n' ? 0 : c;
+    }
+
+    bool suffix_less(const unsigned char *data, uint32_t size,
+                     uint32_t lhs, uint32_t rhs, uint32_t depth) {
+        for (;; depth++) {
+            int l = suffix_byte(data, size, lhs, depth);
+            int r = suffix_byte(data, size, rhs, depth);
+            if (l != r)
+                return l < r;
+            if (l < 0)
+                return false;
+        }
+    }
+
+    /*
+     * Sorts the suffixes at [begin, end), which share their first
+     * `depth' bytes, with a multikey quicksort: a three-way partition
+     * on one byte, then on to the next byte for the middle part.
+     */
+    void sort_suffixes(const unsigned char *data, uint32_t size,
+                       uint32_t *begin, uint32_t *end, uint32_t depth) {
+        while (end - begin > 16) {
+            int pivot = suffix_byte(data, size, begin[(end - begin) / 2], depth);
+            uint32_t *lt = begin, *gt = end, *it = begin;
+            while (it < gt) {
+                int c = suffix_byte(data, size, *it, depth);
+                if (c < pivot)
+                    std::swap(*lt++, *it++);
+                else if (c > pivot)
+                    std::swap(*it, *--gt);
+                else
+                    it++;
+            }
+            sort_suffixes(data, size, begin, lt, depth);
+            sort_suffixes(data, size, gt, end, depth);
+            if (pivot < 0)
+                return;
+            begin = lt;
+            end = gt;
+            depth++;
+        }
+        for (uint32_t *it = begin + 1; it < end; it++) {
+            uint32_t pos = *it, *hole = it;
+            for (; hole > begin && suffix_less(data, size, pos, hole[-1], depth); hole--)
+                *hole = hole[-1];
+            *hole = pos;
+        }
+    }
+};
+
+/*
+ * Sorts only the token starts, which are a fraction of the suffixes a
+ * full array would need. Counting each one's prefix_key() gives the
+ * bucket table, and scattering them into their buckets sorts them by
+ * their first byte, so the buckets can be sorted on `ways' threads.
+ */
+void chunk::build_sparse_suffixes(int ways) {
+    std::fill(buckets, buckets + kPrefixBuckets, 0);
+    for (uint32_t i = 0; i < size; i++) {
+        if (token_start(i))
+            buckets[prefix_key(i) + 1]++;
+    }
+    for (size_t k = 1; k < kPrefixBuckets; k++)
+        buckets[k] += buckets[k - 1];
+
+    nsuffixes = buckets[kPrefixBuckets - 1];
+    suffix_data.resize(nsuffixes);
+    suffix_data.shrink_to_fit();
+    suffixes = suffix_data.data();
+    vector<uint32_t> next(buckets, buckets + kPrefixBuckets - 1);
+    for (uint32_t i = 0; i < size; i++) {
+        if (token_start(i))
+            suffixes[next[prefix_key(i)]++] = i;
+    }
+
+    std::atomic<size_t> bucket(0);
+    auto work = [this, &bucket] {
+        size_t k;
+        while ((k = bucket++) + 1 < kPrefixBuckets) {
+            sort_suffixes(data, size, suffixes + buckets[k],
+                          suffixes + buckets[k + 1], 1);
+        }
+    };
+    vector<std::thread> threads;
+    for (int i = 1; i < ways; i++)
+        threads.emplace_back(work);
+    work();
+    for (auto &t : threads)
+        t.join();
+}
+
+void chunk::build_buckets() {
+    // The suffix array is sorted by prefix_key(), so counting the
+    // suffixes with each key gives the start of each bucket.
+    std::fill(buckets, buckets + kPrefixBuckets, 0);
+    for (uint32_t i = 0; i < nsuffixes; i++)
+        buckets[prefix_key(suffixes[i]) + 1]++;
+    for (size_t k = 1; k < kPrefixBuckets; k++)
+        buckets[k] += buckets[k - 1];
+    assert(buckets[kPrefixBuckets - 1] == nsuffixes);
+}
+
+void chunk::build_line_starts() {
+    find_line_starts(data, suffixes, size, '\n', &line_start_data);
+    line_start_data.shrink_to_fit();
+    line_starts = line_start_data.data();
+    nline_starts = line_start_data.size();
+}
+
+/*
+ * Every line but the first starts just after an `eol', and the
+ * suffixes that start with one are sorted by what follows it -- so
+ * they come first in the suffix array, in the same order as the lines
+ * after them. Only the first line needs to be put in its place.
+ */
+void find_line_starts(const unsigned char *data, const uint32_t *suffixes,
+                      uint32_t size, unsigned char eol, vector<uint32_t> *out) {
+    out->clear();
+    if (size == 0)
+        return;
+    for (uint32_t i = 0; i < size && data[suffixes[i]] == eol; i++) {
+        if (suffixes[i] + 1 < size)
+            out->push_back(suffixes[i] + 1);
+    }
+
+    auto before = [data, eol](uint32_t lhs, uint32_t rhs) {
+        for (;; lhs++, rhs++) {
+            if (data[rhs] == eol)
+                return false;
+            if (data[lhs] == eol || data[lhs] < data[rhs])
+                return true;
+            if (data[lhs] > data[rhs])
+                return false;
+        }
+    };
+    out->insert(upper_bound(out->begin(), out->end(), 0u, before), 0u);
+}
+
+void chunk::finalize_files(const vector<std::unique_ptr<indexed_file>> &all_files) {
     sort(files.begin(), files.end());
 
+    // Merge entries covering identical ranges, and lay their file ids
+    // out in the same order as the merged entries.
+    vector<uint32_t> ids;
+    ids.reserve(file_ids.size());
     vector<chunk_file>::iterator out, in;
     out = in = files.begin();
     while (in != files.end()) {
-        *out = *in;
-        ++in;
-        while (in != files.end() &&
-               out->left == in->left &&
-               out->right == in->right) {
-            out->files.push_back(in->files.front());
+        chunk_file cf = *in;
+        cf.first = ids.size();
+        do {
+            ids.insert(ids.end(), begin_files(*in), end_files(*in));
             ++in;
-        }
-        ++out;
+        } while (in != files.end() &&
+                 cf.left == in->left &&
+                 cf.right == in->right);
+        cf.nfiles = ids.size() - cf.first;
+        *out++ = cf;
     }
     files.resize(out - files.begin());
+    files.shrink_to_fit();
+    file_ids.swap(ids);
 
-    build_tree_names();
-    build_tree();
-}
-
-void chunk::build_tree_names() {
-    for (auto it = files.begin(); it != files.end(); it++) {
-        for (auto it2 = it->files.begin(); it2 != it->files.end(); it2++) {
-            tree_names.insert((*it2)->tree->name);
-        }
+    // Neighbouring ids are mostly from the same tree.
+    const indexed_tree *last = nullptr;
+    for (auto it = file_ids.begin(); it != file_ids.end(); ++it) {
+        const indexed_tree *tree = all_files[*it]->tree;
+        if (tree != last)
+            tree_names.insert(tree->name);
+        last = tree;
     }
+    build_tree();
 }
 
 void chunk::build_tree() {
     assert(is_sorted(files.begin(), files.end()));
-    cf_root = build_tree(0, files.size());
+    right_limit.resize(files.size());
+    build_tree(0, files.size());
 }
 
-unique_ptr<chunk_file_node> chunk::build_tree(int left, int right) {
+int chunk::build_tree(int left, int right) {
     if (right == left)
-        return 0;
+        return -1;
     int mid = (left + right) / 2;
-    auto node = std::make_unique<chunk_file_node>();
-
-    node->chunk = &files[mid];
-    node->left  = build_tree(left, mid);
-    node->right = build_tree(mid + 1, right);
-    node->right_limit = node->chunk->right;
-    if (node->left && node->left->right_limit > node->right_limit)
-        node->right_limit = node->left->right_limit;
-    if (node->right && node->right->right_limit > node->right_limit)
-        node->right_limit = node->right->right_limit;
-    assert(!node->left  || *(node->left->chunk) < *(node->chunk));
-    assert(!node->right || *(node->chunk) < *(node->right->chunk));
-    return node;
+    int limit = files[mid].right;
+    limit = max(limit, build_tree(left, mid));
+    limit = max(limit, build_tree(mid + 1, right));
+    right_limit[mid] = limit;
+    return limit;
 }
@@ -21,6 +21,9 @@
 
 #include <stdint.h>
 
+#include "src/fm_index.h"
+#include "src/trigram_index.h"
+
 struct indexed_file;
 
 using namespace std;
@@ -28,31 +31,55 @@ using namespace std;
 /*
  * A chunk_file in a given chunk's `files' list means that some or all
  * of bytes `left' through `right' (inclusive on both sides) in
- * chunk->data are present in each of chunk->files.
+ * chunk->data are present in each of the `nfiles' files whose ids
+ * (indexed_file::no) start at chunk->file_ids[first].
  */
 struct chunk_file {
-    list<indexed_file *> files;
     int left;
     int right;
+    uint32_t first;
+    uint32_t nfiles;
     void expand(int l, int r) {
         left  = min(left, l);
         right = max(right, r);
     }
 
     bool operator<(const chunk_file& rhs) const {
-        return left < rhs.left || (left == rhs.left && right < rhs.right);
+        if (left != rhs.left)
+            return left < rhs.left;
+        if (right != rhs.right)
+            return right < rhs.right;
+        return first < rhs.first;
     }
 };
 
 const size_t kMaxGap       = 1 << 10;
 
-struct chunk_file_node {
-    chunk_file *chunk;
-    int right_limit;
-
-    std::unique_ptr<chunk_file_node> left, right;
+// The number of entries in a chunk's prefix bucket table: one for each
+// two-byte prefix, plus a final entry holding the chunk size.
+const size_t kPrefixBuckets = (1 << 16) + 1;
+
+// The classes of position a sparse suffix array (--sparse_suffixes)
+// holds the suffixes of.
+enum {
+    // The first byte of an identifier.
+    kTokenIdent = 0x01,
+    // Any punctuation byte.
+    kTokenPunct = 0x02,
 };
 
+// Identifiers are made of letters, digits, underscores and any
+// non-ASCII byte, so that a token never starts inside a multibyte
+// character.
+inline bool token_ident_byte(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+        (c >= '0' && c <= '9') || c == '_' || c >= 0x80;
+}
+
+inline bool token_punct_byte(unsigned char c) {
+    return c > ' ' && c < 0x7f && !token_ident_byte(c);
+}
+
 struct chunk {
     // total number of chunk_file objects across all chunks.
     static int chunk_files;
@@ -64,6 +91,9 @@ struct chunk {
     // chunk's data. Sorted (and compacted) at the very end of index creation.
     vector<chunk_file> files;
 
+    // The file ids for every entry in `files', stored back to back.
+    vector<uint32_t> file_ids;
+
     // Collects the names of all trees indexed in this chunk, to enable
     // short-circuiting based on a repo constraint.
     set<string> tree_names;
@@ -75,28 +105,95 @@ struct chunk {
     // finish_file(), and this vector is cleared.
     vector<chunk_file> cur_file;
 
-    // BST constructed from `files` at the very end of index creation. Used to
-    // efficiently find, given a substring of this chunk's data, the files
-    // might contain that substring.
-    unique_ptr<chunk_file_node> cf_root;
+    // Implicit interval tree over `files`, constructed at the very end of
+    // index creation. Used to efficiently find, given a substring of this
+    // chunk's data, the files that might contain that substring. The
+    // subtree covering files[lo, hi) is rooted at files[(lo + hi) / 2], and
+    // right_limit[] holds the largest `right` within each such subtree.
+    vector<int> right_limit;
 
     // The suffix array; constructed from `data` during finalization (once the
     // chunk's data block is full, but before all files have been processed).
     uint32_t *suffixes;
 
+    // The number of entries in `suffixes'. That is `size', unless
+    // `sparse' names the token classes whose starts are the only
+    // suffixes it holds. A sparse suffix array lives in `suffix_data',
+    // or in a loaded index.
+    uint32_t nsuffixes;
+    unsigned sparse;
+    vector<uint32_t> suffix_data;
+
+    // buckets[k] is the index into `suffixes' of the first suffix whose
+    // two-byte prefix_key() is at least k. Built alongside the suffix
+    // array, this lets suffix searches skip straight past the first two
+    // characters of a query.
+    uint32_t *buckets;
+
+    // The suffixes that begin a line, in suffix array order. A plan
+    // anchored at the start of a line need only search these. Points
+    // into `line_start_data', or into a loaded index; null if the chunk
+    // was indexed without them.
+    const uint32_t *line_starts;
+    uint32_t nline_starts;
+    vector<uint32_t> line_start_data;
+
+    // In an index built with --fm_index, an FM-index of `data' takes
+    // the place of `suffixes', `buckets' and `line_starts', which are
+    // all null.
+    fm_index fm;
+
+    // Likewise, with --trigram_index, a trigram_index of the lines of
+    // `data'.
+    trigram_index trigrams;
+
     // Many lines of code, from many files, concatenated together.
     unsigned char *data;
 
-    chunk(unsigned char *data, uint32_t *suffixes)
-        : size(0), files(), cf_root(),
-          suffixes(suffixes), data(data) { }
+    chunk(unsigned char *data, uint32_t *suffixes, uint32_t *buckets,
+          uint8_t *fm_storage = nullptr, unsigned sparse = 0)
+        : size(0), files(), file_ids(), right_limit(),
+          suffixes(suffixes), nsuffixes(0), sparse(sparse), buckets(buckets),
+          line_starts(nullptr), nline_starts(0), fm(fm_storage),
+          data(data) { }
+
+    // Newlines sort before every other byte in the suffix array, so
+    // they (and NULs, which divsufsort_lines cannot tell apart from
+    // them) share bucket 0.
+    static uint32_t prefix_byte(unsigned char c) {
+        return c == '\n' ? 0 : c;
+    }
+
+    uint32_t prefix_key(uint32_t i) const {
+        unsigned char next = i + 1 < size ? data[i + 1] : '\n';
+        return prefix_byte(data[i]) << 8 | prefix_byte(next);
+    }
+
+    // Whether position `i' starts one of the token classes in `sparse'.
+    bool token_start(uint32_t i) const {
+        unsigned char c = data[i];
+        if ((sparse & kTokenPunct) && token_punct_byte(c))
+            return true;
+        return (sparse & kTokenIdent) && token_ident_byte(c) &&
+            (i == 0 || !token_ident_byte(data[i - 1]));
+    }
+
+    const uint32_t *begin_files(const chunk_file &cf) const {
+        return file_ids.data() + cf.first;
+    }
+    const uint32_t *end_files(const chunk_file &cf) const {
+        return file_ids.data() + cf.first + cf.nfiles;
+    }
 
     void add_chunk_file(indexed_file *sf, const string_view& line);
     void finish_file();
-    void finalize();
-    void finalize_files();
-    void build_tree_names();
+    // Builds the chunk's index, on up to `ways' threads.
+    void finalize(int ways = 1);
+    void finalize_files(const vector<std::unique_ptr<indexed_file>> &all_files);
     void build_tree();
+    void build_buckets();
+    void build_sparse_suffixes(int ways);
+    void build_line_starts();
 
     struct lt_suffix {
         const chunk *chunk_;
@@ -134,7 +231,7 @@ struct chunk {
         }
     };
 
-    unique_ptr<chunk_file_node> build_tree(int left, int right);
+    int build_tree(int left, int right);
 
 private:
     chunk(const chunk&);
@@ -143,4 +240,11 @@ private:
 
 extern size_t kChunkSpace;
 
+// Fills `out' with the positions in `data' that begin a line, in the
+// order `suffixes' sorts them. `eol' must sort before every other
+// byte in `suffixes', as it does for both chunks and the filename
+// index.
+void find_line_starts(const unsigned char *data, const uint32_t *suffixes,
+                      uint32_t size, unsigned char eol, vector<uint32_t> *out);
+
 #endif
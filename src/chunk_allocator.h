@@ -8,8 +8,10 @@
 #ifndef CODESEARCH_CHUNK_ALLOCATOR_H
 #define CODESEARCH_CHUNK_ALLOCATOR_H
 
+#include <atomic>
 #include <vector>
 #include <map>
+#include <memory>
 #include <string>
 #include <thread>
 #include <assert.h>
@@ -18,6 +20,7 @@
 
 using namespace std;
 struct chunk;
+struct indexed_file;
 class code_searcher;
 
 struct buffer {
@@ -36,6 +39,26 @@ public:
         return chunk_size_;
     }
 
+    // Whether chunks are indexed with an fm_index rather than a suffix
+    // array.
+    void set_use_fm_index(bool fm);
+    bool use_fm_index() const {
+        return use_fm_index_;
+    }
+
+    // Or with a trigram_index.
+    void set_use_trigram_index(bool trigrams);
+    bool use_trigram_index() const {
+        return use_trigram_index_;
+    }
+
+    // The token classes a sparse suffix array holds the starts of;
+    // 0 if chunks are indexed with a full one.
+    void set_sparse_classes(unsigned classes);
+    unsigned sparse_classes() const {
+        return sparse_classes_;
+    }
+
     unsigned char *alloc(size_t len);
     uint8_t *alloc_content_data(size_t len);
 
@@ -69,7 +92,8 @@ public:
     }
 
     void skip_chunk();
-    virtual void finalize();
+    // Finishes the chunks, whose file ids index `files'.
+    virtual void finalize(const vector<std::unique_ptr<indexed_file>> &files);
 
     chunk *chunk_from_string(const unsigned char *p);
 
@@ -84,6 +108,9 @@ protected:
     void new_chunk();
 
     size_t chunk_size_;
+    bool use_fm_index_;
+    bool use_trigram_index_;
+    unsigned sparse_classes_;
     vector<chunk*> chunks_;
     vector<buffer> content_chunks_;
 
@@ -100,6 +127,7 @@ protected:
     // in the background.
     thread_queue<chunk*> finalize_queue_;
     vector<std::thread> threads_;
+    std::atomic<int> finalizing_;
 
     // Used by chunk_from_string() to efficiently find the chunk containing an
     // already-indexed line of code.
@@ -10,6 +10,7 @@
 #include <string.h>
 #include <sys/mman.h>
 
+#include <algorithm>
 #include <locale>
 #include <list>
 #include <iostream>
@@ -24,11 +25,15 @@
 #include "src/lib/radix_sort.h"
 #include "src/lib/per_thread.h"
 #include "src/lib/debug.h"
+#include "src/lib/executor.h"
 
 #include "src/codesearch.h"
 #include "src/chunk.h"
 #include "src/chunk_allocator.h"
 #include "src/query_planner.h"
+#include "src/literal_filter.h"
+#include "src/query_cache.h"
+#include "src/corpus_stats.h"
 #include "src/content.h"
 
 #include "absl/strings/string_view.h"
@@ -46,6 +51,30 @@ using namespace std;
 const size_t kMinSkip = 250;
 const int kMinFilterRatio = 50;
 const int kMaxScan        = (1 << 20);
+// An fm_index range this small is located as it stands, rather than
+// narrowed any further.
+const uint32_t kMinFMRange = 4;
+// How far into a plan, and across how many of its nodes, to look for
+// a step a sparse suffix array can search from.
+const int kMaxSparseShift    = 8;
+const size_t kMaxSparseNodes = 64;
+// How many nodes of a plan a trigram_index search follows, and the
+// most bytes one step of it may match before the search stops there.
+const int kMaxTrigramNodes    = 1024;
+const unsigned kMaxTrigramFanout = 16;
+// Don't split the search of a chunk into pieces smaller than this.
+const int kMinSplit       = (1 << 20);
+// Stop starting new chunks while this many matches are waiting to be
+// consumed.
+const size_t kMaxQueuedMatches = (1 << 12);
+// How many exit_early() calls each thread makes per check of the
+// clock and of query::cancelled. Loops whose every step can be costly
+// call check() instead.
+const unsigned kExitPollInterval = 64;
+// Smallest candidate buffer to use when prefiltering files by path.
+const size_t kMinPathCandidates = (1 << 12);
+// Most suffix-array candidates a candidate_set keeps, over all chunks.
+const size_t kMaxSetCandidates = (1 << 16);
 
 DEFINE_bool(index, true, "Create a suffix-array index to speed searches.");
 DEFINE_bool(compress, true, "Compress file contents linewise");
@@ -54,6 +83,9 @@ DEFINE_bool(search, true, "Actually do the search.");
 DEFINE_int32(timeout, 1000, "The number of milliseconds a single search may run for.");
 DEFINE_int32(threads, 4, "Number of threads to use.");
 DEFINE_int32(line_limit, 1024, "Maximum line length to index.");
+DEFINE_int64(re2_thread_max_mem, 8 << 20,
+             "Memory budget for each search thread's copy of a query's regex. "
+             "0 shares a single copy between all threads.");
 
 namespace {
     metric idx_bytes("index.bytes");
@@ -64,6 +96,25 @@ namespace {
     metric idx_data_chunks("index.data.chunks");
     metric idx_content_chunks("index.content.chunks");
     metric idx_content_ranges("index.content.ranges");
+
+    // Shared by every search_thread in the process. Built on first
+    // use, once flags have been parsed, and never torn down.
+    executor *search_executor() {
+        static executor *exec = new executor(FLAGS_threads);
+        return exec;
+    }
+
+    bool plain_literal(const string &pat) {
+        return !pat.empty() &&
+            pat.find_first_of("\\.^$|?*+()[]{}") == string::npos;
+    }
+
+    string ascii_lower(string s) {
+        std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) {
+                return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+            });
+        return s;
+    }
 };
 
 #ifdef __APPLE__
@@ -97,16 +148,23 @@ const StringPiece empty_string(NULL, 0);
 
 class search_limiter {
 public:
-    search_limiter(int query_max_matches) : matches_(0), max_matches_(query_max_matches), exit_reason_(kExitNone) {
-        if (FLAGS_timeout <= 0) {
-            deadline_.tv_sec = numeric_limits<time_t>::max();
-        } else {
-            timeval timeout = {
-                0, FLAGS_timeout * 1000
-            }, now;
-            gettimeofday(&now, NULL);
-            timeval_add(&deadline_, &now, &timeout);
+    search_limiter(const query &q) : matches_(0), max_matches_(q.max_matches),
+                                     cancelled_(q.cancelled),
+                                     exit_reason_(kExitNone) {
+        int64_t now = coarse_ns();
+        deadline_ = numeric_limits<int64_t>::max();
+        if (FLAGS_timeout > 0)
+            deadline_ = now + int64_t(FLAGS_timeout) * 1000000;
+        if (q.deadline.tv_sec) {
+            // query::deadline is wall-clock time; convert it to the
+            // monotonic clock once, here.
+            timeval wall;
+            gettimeofday(&wall, NULL);
+            int64_t left = (int64_t(q.deadline.tv_sec) - wall.tv_sec) * 1000000000 +
+                (int64_t(q.deadline.tv_usec) - wall.tv_usec) * 1000;
+            deadline_ = min(deadline_, now + left);
         }
+        poll(now);
     }
 
     exit_reason why() {
@@ -117,20 +175,18 @@ public:
         if (exit_reason_)
             return true;
 
-#ifdef CODESEARCH_SLOWGTOD
-        static int counter = 1000;
-        if (--counter)
+        static thread_local unsigned polls;
+        if (++polls % kExitPollInterval)
             return false;
-        counter = 1000;
-#endif
-        timeval now;
-        gettimeofday(&now, NULL);
-        if (now.tv_sec > deadline_.tv_sec ||
-            (now.tv_sec == deadline_.tv_sec && now.tv_usec > deadline_.tv_usec)) {
-            exit_reason_ = kExitTimeout;
+        return poll(coarse_ns());
+    }
+
+    // exit_early(), but checking the clock and query::cancelled every
+    // time.
+    bool check() {
+        if (exit_reason_)
             return true;
-        }
-        return false;
+        return poll(coarse_ns());
     }
 
     void record_match() {
@@ -143,9 +199,23 @@ public:
     }
 
 protected:
+    bool poll(int64_t now) {
+        if (cancelled_ && cancelled_()) {
+            exit_reason_ = kExitCancelled;
+            return true;
+        }
+        if (now > deadline_) {
+            exit_reason_ = kExitTimeout;
+            return true;
+        }
+        return false;
+    }
+
     atomic_int matches_;
     int max_matches_;
-    timeval deadline_;
+    std::function<bool ()> cancelled_;
+    // In coarse_ns() time.
+    int64_t deadline_;
     exit_reason exit_reason_;
 };
 
@@ -178,27 +248,98 @@ bool accept(const query *q, const indexed_file *file) {
     return true;
 }
 
-bool accept(const query *q, const list<indexed_file *> &sfs) {
-    for (list<indexed_file *>::const_iterator it = sfs.begin();
-         it != sfs.end(); ++it) {
-        if (accept(q, *it))
+int suffix_search(const unsigned char *data,
+                  const uint32_t *suffixes,
+                  const uint32_t *buckets,
+                  int size,
+                  const uint32_t *line_starts,
+                  int nline_starts,
+                  intrusive_ptr<QueryPlan> index,
+                  vector<uint32_t> &indexes_out,
+                  unsigned char eol);
+static int chunk_search(const chunk *chunk, intrusive_ptr<QueryPlan> index,
+                        vector<uint32_t> &indexes_out);
+
+/*
+ * Memoizes accept() for the duration of a single query, so that the
+ * path and tree regexes run at most once per file no matter how many
+ * chunk_file ranges the file shows up in.
+ *
+ * File patterns with a usable index key are also looked up in the
+ * filename suffix array up front, and every file that contains none
+ * of the candidate positions is rejected without running the regex.
+ */
+class file_filter {
+public:
+    file_filter(const code_searcher *cc, const query *q);
+
+    bool operator()(uint32_t id) {
+        if (!constrained_)
             return true;
+        uint8_t st = state_[id].load(std::memory_order_relaxed);
+        if (st == kUnknown) {
+            st = accept(query_, cc_->files_[id].get()) ? kAccepted : kRejected;
+            state_[id].store(st, std::memory_order_relaxed);
+        }
+        return st == kAccepted;
+    }
+
+    bool operator()(const indexed_file *file) {
+        return (*this)(file->no);
+    }
+
+    // Does `cf' cover any accepted file?
+    bool operator()(const chunk *chunk, const chunk_file &cf) {
+        if (!constrained_)
+            return true;
+        for (const uint32_t *it = chunk->begin_files(cf);
+             it != chunk->end_files(cf); ++it) {
+            if ((*this)(*it))
+                return true;
+        }
+        return false;
     }
-    return false;
-}
+
+protected:
+    enum : uint8_t {
+        kUnknown = 0,
+        kRejected,
+        kAccepted,
+    };
+
+    void prefilter(const std::shared_ptr<RE2> &pat);
+
+    const code_searcher *cc_;
+    const query *query_;
+    bool constrained_;
+    vector<std::atomic<uint8_t>> state_;
+};
 
 class searcher {
 public:
     searcher(const code_searcher *cc,
              const query &q,
              const intrusive_ptr<QueryPlan> index_key,
+             file_filter *filter,
              const code_searcher::search_thread::transform_func& func) :
         cc_(cc), query_(&q), transform_(func), queue_(),
-        limiter_(q.max_matches), index_key_(index_key), re2_time_(false),
+        limiter_(q), index_key_(index_key), re2_time_(false),
         git_time_(false), index_time_(false), sort_time_(false),
-        analyze_time_(false), files_(cc->files_.size(), 0xff),
-        files_density_(-1)
-    {}
+        analyze_time_(false), filter_(filter),
+        max_ways_(1), files_density_(-1)
+    {
+        if (FLAGS_re2_thread_max_mem > 0)
+            line_pats_.resize(search_executor()->size());
+
+        const RE2::Options &opts = q.line_pat->options();
+        const string &pat = q.line_pat->pattern();
+        if (opts.case_sensitive() &&
+            (opts.literal() || plain_literal(pat)) &&
+            !pat.empty() && pat.find('\n') == string::npos)
+            literal_ = pat;
+        else
+            literals_ = literal_filter::for_regex(*q.line_pat);
+    }
 
     ~searcher() {
         debug(kDebugProfile, "re2 time: %d.%06ds",
@@ -217,6 +358,19 @@ public:
 
     void operator()(const chunk *chunk);
 
+    typedef std::function<void (const std::function<void ()>&)> spawn_func;
+
+    /*
+     * Allow the search of a single chunk to be split into up to
+     * `ways' line-aligned pieces. All but one of the pieces are handed
+     * to `spawn', which must arrange for them to run before the
+     * searcher's queue is closed.
+     */
+    void set_spawn(const spawn_func& spawn, int ways) {
+        spawn_ = spawn;
+        max_ways_ = ways;
+    }
+
     void get_stats(match_stats *stats) {
         struct timeval t;
 
@@ -248,7 +402,16 @@ protected:
                      size_t minpos, size_t maxpos);
 
     void filtered_search(const chunk *chunk);
-    void search_lines(uint32_t *left, int count, const chunk *chunk);
+    void search_lines(uint32_t *left, int count, const chunk *chunk,
+                      bool exact = false);
+    void search_ranges(const uint32_t *indexes, int count, const chunk *chunk);
+    void search_literal(const uint32_t *indexes, int count, const chunk *chunk);
+
+    int split_ways(size_t bytes) {
+        if (!spawn_)
+            return 1;
+        return max(1, min(max_ways_, int(bytes / kMinSplit)));
+    }
 
     double files_density(void) {
         std::unique_lock<std::mutex> locked(mtx_);
@@ -258,7 +421,7 @@ protected:
         int hits = 0;
         int sample = min(1000, int(cc_->files_.size()));
         for (int i = 0; i < sample; i++) {
-            if (accept(query_, cc_->files_[rand() % cc_->files_.size()].get()))
+            if ((*filter_)(cc_->files_[rand() % cc_->files_.size()].get()))
                 hits++;
         }
         return (files_density_ = double(hits) / sample);
@@ -283,14 +446,17 @@ p     * which contain `match', which is contained within `line'.
                     const StringPiece& line);
 
     /*
-     * Given a matching substring, its containing line, and a search
-     * file, determine whether that file actually contains that line,
-     * and if so, post results to queue_
+     * Given a matching substring, its containing line (which lies in
+     * `chunk'), and a search file, determine whether that file
+     * actually contains that line, and if so, post results to queue_
      */
-    void try_match(const StringPiece&,
+    void try_match(const chunk *chunk,
+                   const StringPiece&,
                    const StringPiece&,
                    indexed_file *);
 
+    const RE2 &line_pat();
+
     static int line_start(const chunk *chunk, int pos) {
         const unsigned char *start = static_cast<const unsigned char*>
             (memrchr(chunk->data, '\n', pos));
@@ -337,7 +503,34 @@ p     * which contain `match', which is contained within `line'.
     timer index_time_;
     timer sort_time_;
     timer analyze_time_;
-    vector<uint8_t> files_;
+    file_filter *filter_;
+    spawn_func spawn_;
+    int max_ways_;
+
+    /*
+     * Copies of query_->line_pat, one per executor worker, each
+     * compiled by its worker the first time it needs it. RE2 guards
+     * its lazily-built DFA with a lock and a single memory budget, so
+     * sharing one RE2 between all the workers serializes them on hard
+     * regexes.
+     */
+    vector<std::unique_ptr<RE2>> line_pats_;
+
+    /*
+     * If line_pat is a case-sensitive literal, the literal itself.
+     * Every position suffix_search returns for it starts either an
+     * occurrence of the literal or, once a suffix array range gets
+     * small enough to stop refining, a prefix of one, so candidates
+     * can be checked with a memcmp instead of an RE2 scan.
+     */
+    string literal_;
+
+    /*
+     * Literals that every match of line_pat must contain, if it has
+     * any. full_search scans for them ahead of RE2 and only runs RE2
+     * over the lines they turn up on.
+     */
+    std::unique_ptr<literal_filter> literals_;
 
     /*
      * The approximate ratio of how many files match file_pat and
@@ -354,8 +547,10 @@ class filename_searcher {
 public:
     filename_searcher(const code_searcher *cc,
                       const query &q,
-                      intrusive_ptr<QueryPlan> index_key) :
-        cc_(cc), query_(&q), index_key_(index_key), queue_(), limiter_(q.max_matches)
+                      intrusive_ptr<QueryPlan> index_key,
+                      file_filter *filter) :
+        cc_(cc), query_(&q), index_key_(index_key), filter_(filter),
+        queue_(), limiter_(q)
     {}
 
     void operator()();
@@ -370,17 +565,62 @@ protected:
     const code_searcher *cc_;
     const query *query_;
     intrusive_ptr<QueryPlan> index_key_;
+    file_filter *filter_;
     thread_queue<file_result*> queue_;
     search_limiter limiter_;
 
     friend class code_searcher::search_thread;
 };
 
-int suffix_search(const unsigned char *data,
-                  const uint32_t *suffixes,
-                  int size,
-                  intrusive_ptr<QueryPlan> index,
-                  vector<uint32_t> &indexes_out);
+file_filter::file_filter(const code_searcher *cc, const query *q)
+    : cc_(cc), query_(q),
+      constrained_(!q->file_pats.empty() || q->tree_pat ||
+                   !q->negate.file_pats.empty() || q->negate.tree_pat),
+      state_(constrained_ ? cc->files_.size() : 0) {
+    if (!FLAGS_index)
+        return;
+    for (const auto &pat : q->file_pats)
+        prefilter(pat);
+}
+
+void file_filter::prefilter(const std::shared_ptr<RE2> &pat) {
+    intrusive_ptr<QueryPlan> key = query_cache::shared()->plan(pat);
+    if (!key || key->empty())
+        return;
+
+    static per_thread<vector<uint32_t> > indexes;
+    if (!indexes.get())
+        indexes.put(new vector<uint32_t>);
+    size_t want = max(kMinPathCandidates,
+                      cc_->filename_data_.size() / kMinFilterRatio);
+    if (indexes->size() < want)
+        indexes->resize(want);
+
+    int count = suffix_search(cc_->filename_data_.data(),
+                              cc_->filename_suffixes_.data(), nullptr,
+                              cc_->filename_data_.size(),
+                              cc_->filename_line_starts_.data(),
+                              cc_->filename_line_starts_.size(),
+                              key, *indexes, '\0');
+    if (count > indexes->size())
+        return;
+
+    vector<bool> hit(cc_->files_.size());
+    auto &positions = cc_->filename_positions_;
+    for (int i = 0; i < count; i++) {
+        int pos = (*indexes)[i];
+        auto it = upper_bound(positions.begin(), positions.end(), pos,
+                              [](int pos, const pair<int, indexed_file*> &p) {
+                                  return pos < p.first;
+                              });
+        assert(it != positions.begin());
+        hit[(it - 1)->second->no] = true;
+    }
+    for (size_t i = 0; i < hit.size(); i++) {
+        if (!hit[i])
+            state_[i].store(kRejected, std::memory_order_relaxed);
+    }
+}
 
 void filename_searcher::operator()()
 {
@@ -390,8 +630,11 @@ void filename_searcher::operator()()
     }
 
     int count = suffix_search(cc_->filename_data_.data(),
-                              cc_->filename_suffixes_.data(),
-                              cc_->filename_data_.size(), index_key_, *indexes);
+                              cc_->filename_suffixes_.data(), nullptr,
+                              cc_->filename_data_.size(),
+                              cc_->filename_line_starts_.data(),
+                              cc_->filename_line_starts_.size(),
+                              index_key_, *indexes, '\0');
 
     if (count > indexes->size()) {
         for (auto it = cc_->files_.begin(); it < cc_->files_.end(); it++) {
@@ -444,7 +687,7 @@ void filename_searcher::operator()()
 }
 
 void filename_searcher::match_filename(indexed_file *file) {
-    if (!accept(query_, file))
+    if (!(*filter_)(file))
         return;
 
     StringPiece filepath = StringPiece(file->path);
@@ -463,8 +706,11 @@ void filename_searcher::match_filename(indexed_file *file) {
 }
 
 code_searcher::code_searcher()
-    : alloc_(), finalized_(false), filename_data_(), filename_suffixes_()
+    : alloc_(), finalized_(false), stats_(new corpus_stats),
+      filename_data_(), filename_suffixes_()
 {
+    static std::atomic<uint64_t> generations;
+    generation_ = ++generations;
 }
 
 void code_searcher::set_alloc(std::unique_ptr<chunk_allocator> alloc) {
@@ -499,6 +745,8 @@ void code_searcher::index_filenames() {
     divsufsort(filename_data_.data(),
                reinterpret_cast<saidx_t*>(filename_suffixes_.data()),
                filename_data_size);
+    find_line_starts(filename_data_.data(), filename_suffixes_.data(),
+                     filename_data_size, '\0', &filename_line_starts_);
 }
 
 void code_searcher::finalize() {
@@ -510,7 +758,7 @@ void code_searcher::finalize() {
     index_timestamp_ = now.tv_sec;
 
     index_filenames();
-    alloc_->finalize();
+    alloc_->finalize(files_);
 
     idx_data_chunks.inc(alloc_->end() - alloc_->begin());
     idx_content_chunks.inc(alloc_->end_content() - alloc_->begin_content());
@@ -524,6 +772,16 @@ vector<indexed_tree> code_searcher::trees() const {
     return out;
 }
 
+long code_searcher::count_candidates(const intrusive_ptr<QueryPlan> &plan) const {
+    assert(finalized_);
+    long total = 0;
+    vector<uint32_t> indexes(alloc_->chunk_size() + 1);
+    for (auto it = alloc_->begin(); it != alloc_->end(); ++it) {
+        total += chunk_search(*it, plan, indexes);
+    }
+    return total;
+}
+
 const indexed_tree* code_searcher::open_tree(const string &name,
                                              const Metadata &metadata,
                                              const string &version) {
@@ -543,54 +801,88 @@ const indexed_tree* code_searcher::open_tree(const string &name,
 void code_searcher::index_file(const indexed_tree *tree,
                                const string& path,
                                StringPiece contents) {
-    assert(!finalized_);
-    assert(alloc_);
-    size_t len = contents.size();
-    const char *p = contents.data();
+    prepared_file file;
+    file.tree = tree;
+    file.path = path;
+    file.contents = contents;
+    prepare_file(&file);
+    commit_file(file);
+}
+
+void code_searcher::prepare_file(prepared_file *file) {
+    size_t len = file->contents.size();
+    const char *begin = file->contents.data();
+    const char *p = begin;
     const char *end = p + len;
     const char *f;
+
+    file->lines.clear();
+    file->binary = memchr(p, 0, len) != NULL;
+    if (file->binary)
+        return;
+
+    auto add = [&](const char *p, const char *f) {
+        if (f - p + 1 >= FLAGS_line_limit) {
+            // Don't index the long line, but do index an empty
+            // line so that line number of future lines are
+            // preserved.
+            p = f;
+        }
+        prepared_file::line line = {uint32_t(p - begin), uint32_t(f - p), 0};
+        if (FLAGS_compress)
+            line.hash = hashstr()(StringPiece(p, f - p));
+        file->lines.push_back(line);
+    };
+    while ((f = static_cast<const char*>(memchr(p, '\n', end - p))) != 0) {
+        add(p, f);
+        p = min(end, f + 1);
+    }
+    if (p < end - 1) {
+        // Handle files with no trailing newline by adding the final
+        // line.
+        assert(*(end-1) != '\n');
+        add(p, end);
+    }
+}
+
+void code_searcher::commit_file(const prepared_file &pf) {
+    assert(!finalized_);
+    assert(alloc_);
     chunk *c;
     chunk *prev = NULL;
     StringPiece line;
 
-    if (memchr(p, 0, len) != NULL)
+    if (pf.binary)
         return;
 
-    idx_bytes.inc(len);
+    idx_bytes.inc(pf.contents.size());
     idx_files.inc();
 
     auto file = std::make_unique<indexed_file>();
-    file->tree = tree;
-    file->path = path;
+    file->tree = pf.tree;
+    file->path = pf.path;
     file->no  = files_.size();
     auto *sf = file.get();
     files_.push_back(move(file));
 
-    uint32_t lines = count(p, end, '\n');
-
     file_contents_builder content;
 
-    while ((f = static_cast<const char*>(memchr(p, '\n', end - p))) != 0) {
-    final:
+    for (auto &l : pf.lines) {
+        const char *p = pf.contents.data() + l.off;
         idx_lines.inc();
-        if (f - p + 1 >= FLAGS_line_limit) {
-            // Don't index the long line, but do index an empty
-            // line so that line number of future lines are
-            // preserved.
-            p = f;
-        }
         decltype(lines_)::iterator it = lines_.end();
         if (FLAGS_compress) {
-            it = lines_.find(StringPiece(p, f - p));
+            it = lines_.find(StringPiece(p, l.len), l.hash);
         }
         if (it == lines_.end()) {
-            idx_bytes_dedup.inc((f - p) + 1);
+            idx_bytes_dedup.inc(l.len + 1);
             idx_lines_dedup.inc();
 
-            unsigned char *alloc = alloc_->alloc(f - p + 1);
-            memcpy(alloc, p, f - p);
-            alloc[f - p] = '\n';
-            line = StringPiece((char*)alloc, f - p);
+            unsigned char *alloc = alloc_->alloc(l.len + 1);
+            memcpy(alloc, p, l.len);
+            alloc[l.len] = '\n';
+            stats_->add(alloc, l.len + 1);
+            line = StringPiece((char*)alloc, l.len);
             if (FLAGS_compress) {
                 if (alloc_->current_chunk() != prev)
                     lines_.clear();
@@ -606,26 +898,17 @@ void code_searcher::index_file(const indexed_tree *tree,
             c->add_chunk_file(sf, line);
         }
         content.extend(c, line);
-        p = min(end, f + 1);
-    }
-    if (p < end - 1) {
-        // Handle files with no trailing newline by jumping back and
-        // adding the final line.
-        assert(*(end-1) != '\n');
-        f = end;
-        lines++;
-        goto final;
     }
 
     sf->content = content.build(alloc_.get());
     if (sf->content == 0) {
         fprintf(stderr, "WARN: %s:%s:%s is too large to be indexed.\n",
-                tree->name.c_str(), tree->version.c_str(), path.c_str());
+                pf.tree->name.c_str(), pf.tree->version.c_str(), pf.path.c_str());
         file_contents_builder dummy;
         sf->content = dummy.build(alloc_.get());
     }
     idx_content_ranges.inc(sf->content->size());
-    assert(sf->content->size() <= 3*lines);
+    assert(sf->content->size() <= pf.lines.size());
 
     for (auto it = alloc_->begin();
          it != alloc_->end(); it++) {
@@ -651,7 +934,7 @@ bool searcher::should_search_chunk(const chunk *chunk) {
 
 void searcher::operator()(const chunk *chunk)
 {
-    if (limiter_.exit_early())
+    if (limiter_.check())
         return;
 
     if (!should_search_chunk(chunk))
@@ -667,6 +950,9 @@ struct walk_state {
     const uint32_t *left, *right;
     intrusive_ptr<QueryPlan> key;
     int depth;
+    // Whether [left, right) lies in the full suffix array, rather than
+    // in its line starts, so that the bucket table applies.
+    bool full;
 };
 
 struct lt_index {
@@ -689,19 +975,108 @@ struct lt_index {
     }
 };
 
+namespace {
+    uint32_t line_of(const unsigned char *data, uint32_t pos, unsigned char eol) {
+        const unsigned char *p = static_cast<const unsigned char*>
+            (memrchr(data, eol, pos));
+        return p ? p - data + 1 : 0;
+    }
+};
+
+/*
+ * Candidates for a conjunction are those of its first, most selective
+ * conjunct, less any whose line has no candidate for one of the
+ * others. A conjunct with too many candidates to collect is skipped;
+ * it would hardly narrow the search anyway.
+ */
+template <class Search>
+static int conjunct_search(const unsigned char *data,
+                           Search search,
+                           intrusive_ptr<QueryPlan> index,
+                           vector<uint32_t> &indexes_out,
+                           unsigned char eol) {
+    static per_thread<vector<uint32_t> > lines;
+    if (!lines.get())
+        lines.put(new vector<uint32_t>);
+    if (lines->size() < indexes_out.size())
+        lines->resize(indexes_out.size());
+
+    const auto &parts = index->conjuncts();
+    int count = search(parts[0], indexes_out);
+    for (size_t i = 1; i < parts.size() && count <= indexes_out.size(); i++) {
+        if (count == 0)
+            break;
+        int n = search(parts[i], *lines);
+        if (n > lines->size())
+            continue;
+        uint32_t *begin = lines->data(), *end = begin + n;
+        for (uint32_t *it = begin; it != end; ++it)
+            *it = line_of(data, *it, eol);
+        lsd_radix_sort(begin, end);
+        end = std::unique(begin, end);
+
+        int kept = 0;
+        for (int j = 0; j < count; j++) {
+            if (std::binary_search(begin, end, line_of(data, indexes_out[j], eol)))
+                indexes_out[kept++] = indexes_out[j];
+        }
+        count = kept;
+    }
+    return count;
+}
+
 int suffix_search(const unsigned char *data,
                   const uint32_t *suffixes,
+                  const uint32_t *buckets,
                   int size,
+                  const uint32_t *line_starts,
+                  int nline_starts,
                   intrusive_ptr<QueryPlan> index,
-                  vector<uint32_t> &indexes_out) {
+                  vector<uint32_t> &indexes_out,
+                  unsigned char eol) {
+    if (index && !index->conjuncts().empty()) {
+        auto search = [&](intrusive_ptr<QueryPlan> key, vector<uint32_t> &out) {
+            return suffix_search(data, suffixes, buckets, size,
+                                 line_starts, nline_starts, key, out, eol);
+        };
+        return conjunct_search(data, search, index, indexes_out, eol);
+    }
+
+    // A plan anchored at the start of a line need only walk the
+    // suffixes that begin one.
+    auto root = [&](intrusive_ptr<QueryPlan> key) {
+        if (line_starts && key && (key->anchor & kAnchorLineStart))
+            return (walk_state){line_starts, line_starts + nline_starts,
+                    key, 0, false};
+        return (walk_state){suffixes, suffixes + size, key, 0, true};
+    };
+
     int count = 0;
     vector<walk_state> stack;
-    stack.push_back((walk_state){
-            suffixes, suffixes + size, index, 0});
+    stack.push_back(root(index));
 
     while (!stack.empty()) {
         walk_state st = stack.back();
         stack.pop_back();
+        if (st.key && !st.key->branches().empty() && (st.right - st.left) > 100) {
+            // Each branch walks the same range; a position more than
+            // one of them matches is a duplicate candidate, which
+            // search_lines tolerates.
+            // A conjunction among them is searched by its first conjunct
+            // alone, which still covers all its matches.
+            for (auto it = st.key->branches().begin();
+                 it != st.key->branches().end(); ++it) {
+                intrusive_ptr<QueryPlan> branch = *it;
+                if (!branch->conjuncts().empty())
+                    branch = branch->conjuncts()[0];
+                if (st.depth == 0)
+                    stack.push_back(root(branch));
+                else
+                    stack.push_back((walk_state){st.left, st.right, branch,
+                                st.depth, st.full});
+            }
+            continue;
+        }
         if (!st.key || st.key->empty() || (st.right - st.left) <= 100) {
             if ((count + st.right - st.left) > indexes_out.size()) {
                 count = indexes_out.size() + 1;
@@ -716,6 +1091,25 @@ int suffix_search(const unsigned char *data,
         for (QueryPlan::iterator it = st.key->begin();
              it != st.key->end(); ++it) {
             const uint32_t *l, *r;
+
+            // Within the first two characters, every single-character
+            // range can be read directly out of the bucket table, as
+            // long as neither character shares a bucket with '\n'.
+            if (buckets && st.full && st.depth < 2 &&
+                it->first.first > '\n' &&
+                (st.depth == 0 || chunk::prefix_byte(data[*st.left]) != 0)) {
+                uint32_t base = st.depth ? data[*st.left] << 8 : 0;
+                int shift = st.depth ? 0 : 8;
+                for (unsigned ch = it->first.first; ch <= it->first.second; ch++) {
+                    l = suffixes + buckets[base + (ch << shift)];
+                    r = suffixes + buckets[base + ((ch + 1) << shift)];
+                    if (r != l) {
+                        stack.push_back((walk_state){l, r, it->second, st.depth + 1, st.full});
+                    }
+                }
+                continue;
+            }
+
             l = lower_bound(st.left, st.right, it->first.first, lt);
             const uint32_t *right = lower_bound(l, st.right,
                                           (unsigned char)(it->first.second + 1),
@@ -739,7 +1133,7 @@ int suffix_search(const unsigned char *data,
                 r = lower_bound(l, right, (unsigned char)(ch + 1), lt);
 
                 if (r != l) {
-                    stack.push_back((walk_state){l, r, it->second, st.depth + 1});
+                    stack.push_back((walk_state){l, r, it->second, st.depth + 1, st.full});
                 }
             }
         }
@@ -747,19 +1141,361 @@ int suffix_search(const unsigned char *data,
     return count;
 }
 
+struct fm_walk_state {
+    uint32_t lo, hi;
+    intrusive_ptr<QueryPlan> key;
+    int depth;
+};
+
+/*
+ * suffix_search for a chunk indexed with an fm_index. Each step of the
+ * walk narrows a range of rows just as a step of suffix_search narrows
+ * a range of the suffix array, but turning a row into a position is
+ * far dearer than reading one out of the suffix array, so ranges are
+ * narrowed all the way down to the end of the plan, or nearly.
+ */
+static int fm_search(const unsigned char *data,
+                     const fm_index &fm,
+                     int size,
+                     intrusive_ptr<QueryPlan> index,
+                     vector<uint32_t> &indexes_out) {
+    if (index && !index->conjuncts().empty()) {
+        auto search = [&](intrusive_ptr<QueryPlan> key, vector<uint32_t> &out) {
+            return fm_search(data, fm, size, key, out);
+        };
+        return conjunct_search(data, search, index, indexes_out, '\n');
+    }
+
+    int count = 0;
+    vector<fm_walk_state> stack;
+    stack.push_back((fm_walk_state){0, fm.rows(), index, 0});
+
+    while (!stack.empty()) {
+        fm_walk_state st = stack.back();
+        stack.pop_back();
+        uint32_t n = st.depth ? st.hi - st.lo : size;
+        if (!st.key || st.key->empty() || n <= kMinFMRange) {
+            if (count + n > indexes_out.size()) {
+                count = indexes_out.size() + 1;
+                break;
+            }
+            // Every position matches the empty pattern; row 0 stands
+            // for the one past the end.
+            for (uint32_t i = 0; i < n; i++)
+                indexes_out[count++] = st.depth ? fm.locate(st.lo + i, st.depth) : i;
+            continue;
+        }
+        if (!st.key->branches().empty()) {
+            for (auto it = st.key->branches().begin();
+                 it != st.key->branches().end(); ++it) {
+                intrusive_ptr<QueryPlan> branch = *it;
+                if (!branch->conjuncts().empty())
+                    branch = branch->conjuncts()[0];
+                stack.push_back((fm_walk_state){st.lo, st.hi, branch, st.depth});
+            }
+            continue;
+        }
+        for (QueryPlan::iterator it = st.key->begin();
+             it != st.key->end(); ++it) {
+            for (unsigned ch = it->first.first; ch <= it->first.second; ch++) {
+                // Like the suffix array, never match across a newline.
+                if (ch == '\n')
+                    continue;
+                uint32_t lo = st.lo, hi = st.hi;
+                if (fm.extend(&lo, &hi, ch))
+                    stack.push_back((fm_walk_state){lo, hi, it->second, st.depth + 1});
+            }
+        }
+    }
+    return count;
+}
+
+namespace {
+    // Whether every byte of [lo, hi), but a newline, is one `pred'
+    // holds for.
+    template <class Pred>
+    bool all_bytes(unsigned lo, unsigned hi, Pred pred) {
+        for (unsigned c = lo; c <= hi; c++) {
+            if (c != '\n' && !pred(c))
+                return false;
+        }
+        return true;
+    }
+
+    // A node of a plan, at some depth, and whether every byte the
+    // plan may have matched just before it is a non-identifier one.
+    typedef pair<QueryPlan*, bool> sparse_node;
+};
+
+/*
+ * A sparse suffix array holds only the suffixes that start a token,
+ * so a plan can only be searched from a step at which every match is
+ * bound to be at one: a step that takes only punctuation, or only
+ * identifier bytes just after a non-identifier one (or the start of
+ * the line). Finds the first such step within kMaxSparseShift of the
+ * start of `key', and returns the plan for the rest of the match from
+ * there, with the length of the step's offset in `*shift'. Returns
+ * null if there is none, and the chunk has to be scanned in full.
+ */
+static intrusive_ptr<QueryPlan> sparse_plan(intrusive_ptr<QueryPlan> key,
+                                            unsigned classes, int *shift) {
+    if (!key || key->empty())
+        return nullptr;
+
+    vector<sparse_node> level, next;
+    std::function<bool (QueryPlan*, bool, int)> add =
+        [&](QueryPlan *node, bool after_nonword, int depth) {
+        if (!node || node->empty())
+            return false;
+        if (!node->conjuncts().empty()) {
+            // Any one conjunct's candidates cover the conjunction's,
+            // but only from where that conjunct itself starts.
+            if (depth)
+                return false;
+            node = node->conjuncts()[0].get();
+        }
+        if (depth == 0 && (node->anchor & kAnchorLineStart))
+            after_nonword = true;
+        for (auto &branch : node->branches()) {
+            if (!add(branch.get(), after_nonword, depth))
+                return false;
+        }
+        if (node->branches().empty())
+            next.push_back(sparse_node(node, after_nonword));
+        return true;
+    };
+
+    if (!add(key.get(), false, 0))
+        return nullptr;
+    for (int depth = 0; depth <= kMaxSparseShift; depth++) {
+        sort(next.begin(), next.end());
+        next.erase(unique(next.begin(), next.end()), next.end());
+        if (next.size() > kMaxSparseNodes)
+            return nullptr;
+        level.swap(next);
+        next.clear();
+
+        bool token_start = true;
+        for (auto &n : level) {
+            for (auto &edge : *n.first) {
+                unsigned lo = edge.first.first, hi = edge.first.second;
+                if ((classes & kTokenPunct) && all_bytes(lo, hi, token_punct_byte))
+                    continue;
+                if ((classes & kTokenIdent) && n.second &&
+                    all_bytes(lo, hi, token_ident_byte))
+                    continue;
+                token_start = false;
+            }
+        }
+        if (token_start) {
+            *shift = depth;
+            if (level.size() == 1)
+                return level[0].first;
+            intrusive_ptr<QueryPlan> plan = new QueryPlan();
+            QueryPlan *last = nullptr;
+            for (auto &n : level) {
+                if (n.first != last)
+                    plan->add_branch(n.first);
+                last = n.first;
+            }
+            return plan;
+        }
+
+        for (auto &n : level) {
+            for (auto &edge : *n.first) {
+                bool nonword = all_bytes(edge.first.first, edge.first.second,
+                                         [](unsigned char c) {
+                                             return !token_ident_byte(c);
+                                         });
+                if (!add(edge.second.get(), nonword, depth + 1))
+                    return nullptr;
+            }
+        }
+    }
+    return nullptr;
+}
+
+/*
+ * suffix_search for a chunk with a sparse suffix array. Returns more
+ * candidates than `indexes_out' holds, as suffix_search does when it
+ * overflows, for a plan sparse_plan() can't place.
+ */
+static int sparse_search(const chunk *chunk, intrusive_ptr<QueryPlan> index,
+                         vector<uint32_t> &indexes_out) {
+    if (index && !index->conjuncts().empty()) {
+        auto search = [&](intrusive_ptr<QueryPlan> key, vector<uint32_t> &out) {
+            return sparse_search(chunk, key, out);
+        };
+        return conjunct_search(chunk->data, search, index, indexes_out, '\n');
+    }
+
+    int shift;
+    intrusive_ptr<QueryPlan> key = sparse_plan(index, chunk->sparse, &shift);
+    if (!key)
+        return indexes_out.size() + 1;
+    int count = suffix_search(chunk->data, chunk->suffixes, chunk->buckets,
+                              chunk->nsuffixes, nullptr, 0, key,
+                              indexes_out, '\n');
+    if (shift && count <= indexes_out.size()) {
+        for (int i = 0; i < count; i++)
+            indexes_out[i] = indexes_out[i] > uint32_t(shift) ? indexes_out[i] - shift : 0;
+    }
+    return count;
+}
+
+/*
+ * Walks a plan as though it were an OR of ANDs of trigrams: each path
+ * through it matches only lines holding every trigram along it, and
+ * the plan only lines some path matches. A path is cut short where it
+ * gets too wide to follow, which only loses some of its trigrams.
+ */
+class trigram_walker {
+public:
+    trigram_walker(const trigram_index &index)
+        : index_(index), budget_(kMaxTrigramNodes), all_(false) { }
+
+    // Fills `out' with the starts of the lines `key' may match;
+    // returns false if they can't be told apart from any others.
+    bool lines(intrusive_ptr<QueryPlan> key, vector<uint32_t> *out) {
+        walk(key.get(), 0, 0, nullptr);
+        if (all_)
+            return false;
+        sort(lines_.begin(), lines_.end());
+        lines_.erase(unique(lines_.begin(), lines_.end()), lines_.end());
+        out->swap(lines_);
+        return true;
+    }
+
+private:
+    // `window' holds the last two bytes of the path to `node', of which
+    // there are `len', and `lines' the lines the trigrams along it all
+    // occur on, or null if there have been none.
+    void walk(QueryPlan *node, uint32_t window, int len,
+              const vector<uint32_t> *lines) {
+        if (all_)
+            return;
+        if (!node || node->empty() || --budget_ < 0) {
+            finish(lines);
+            return;
+        }
+        if (!node->conjuncts().empty()) {
+            // The first conjunct's lines cover the conjunction's, but
+            // it starts a path of its own.
+            if (len) {
+                finish(lines);
+                return;
+            }
+            node = node->conjuncts()[0].get();
+        }
+        for (auto &branch : node->branches())
+            walk(branch.get(), window, len, lines);
+        if (!node->branches().empty())
+            return;
+
+        unsigned width = 0;
+        for (auto &edge : *node)
+            width += edge.first.second - edge.first.first + 1;
+        if (width > kMaxTrigramFanout) {
+            finish(lines);
+            return;
+        }
+        for (auto &edge : *node) {
+            for (unsigned ch = edge.first.first; ch <= edge.first.second; ch++) {
+                if (ch == '\n')
+                    continue;
+                uint32_t next = (window << 8 | ch) & 0xffffff;
+                if (len < 2) {
+                    walk(edge.second.get(), next & 0xffff, len + 1, lines);
+                    continue;
+                }
+                vector<uint32_t> narrowed;
+                if (lines) {
+                    narrowed = *lines;
+                    index_.intersect(next, &narrowed);
+                } else {
+                    index_.postings(next, &narrowed);
+                }
+                if (!narrowed.empty())
+                    walk(edge.second.get(), next & 0xffff, len + 1, &narrowed);
+            }
+        }
+    }
+
+    void finish(const vector<uint32_t> *lines) {
+        if (!lines)
+            all_ = true;
+        else
+            lines_.insert(lines_.end(), lines->begin(), lines->end());
+    }
+
+    const trigram_index &index_;
+    int budget_;
+    bool all_;
+    vector<uint32_t> lines_;
+};
+
+/*
+ * suffix_search for a chunk indexed with a trigram_index. Its
+ * candidates are the starts of lines, rather than of matches.
+ */
+static int trigram_search(const chunk *chunk, intrusive_ptr<QueryPlan> index,
+                          vector<uint32_t> &indexes_out) {
+    if (index && !index->conjuncts().empty()) {
+        auto search = [&](intrusive_ptr<QueryPlan> key, vector<uint32_t> &out) {
+            return trigram_search(chunk, key, out);
+        };
+        return conjunct_search(chunk->data, search, index, indexes_out, '\n');
+    }
+
+    vector<uint32_t> lines;
+    if (!trigram_walker(chunk->trigrams).lines(index, &lines) ||
+        lines.size() > indexes_out.size())
+        return indexes_out.size() + 1;
+    std::copy(lines.begin(), lines.end(), indexes_out.begin());
+    return lines.size();
+}
+
+static int chunk_search(const chunk *chunk, intrusive_ptr<QueryPlan> index,
+                        vector<uint32_t> &indexes_out) {
+    if (chunk->fm.enabled())
+        return fm_search(chunk->data, chunk->fm, chunk->size, index, indexes_out);
+    if (chunk->trigrams.enabled())
+        return trigram_search(chunk, index, indexes_out);
+    if (chunk->sparse)
+        return sparse_search(chunk, index, indexes_out);
+    return suffix_search(chunk->data, chunk->suffixes, chunk->buckets,
+                         chunk->size, chunk->line_starts,
+                         chunk->nline_starts, index, indexes_out, '\n');
+}
+
 void searcher::filtered_search(const chunk *chunk)
 {
     static per_thread<vector<uint32_t> > indexes;
     if (!indexes.get()) {
         indexes.put(new vector<uint32_t>(cc_->alloc_->chunk_size() / kMinFilterRatio));
     }
+
+    if (query_->refine) {
+        auto prev = query_->refine->get(chunk);
+        if (prev) {
+            // search_lines sorts in place, so work on a copy.
+            std::copy(prev->begin(), prev->end(), indexes->begin());
+            search_lines(&(*indexes)[0], prev->size(), chunk);
+            return;
+        }
+    }
+
     int count;
     {
         run_timer run(index_time_);
-        count = suffix_search(chunk->data, chunk->suffixes, chunk->size, index_key_, *indexes);
+        count = chunk_search(chunk, index_key_, *indexes);
     }
+    if (query_->record && count <= indexes->size())
+        query_->record->put(chunk, &(*indexes)[0], count);
 
-    search_lines(&(*indexes)[0], count, chunk);
+    bool exact = !literal_.empty() && !chunk->trigrams.enabled() &&
+        (index_key_->anchor & kAnchorBoth) == kAnchorBoth;
+    search_lines(&(*indexes)[0], count, chunk, exact);
 }
 
 struct match_finger {
@@ -770,7 +1506,7 @@ struct match_finger {
 };
 
 void searcher::search_lines(uint32_t *indexes, int count,
-                            const chunk *chunk)
+                            const chunk *chunk, bool exact)
 {
     debug(kDebugProfile, "search_lines: Searching %d/%d indexes.", count, chunk->size);
 
@@ -793,6 +1529,70 @@ void searcher::search_lines(uint32_t *indexes, int count,
         lsd_radix_sort(indexes, indexes + count);
     }
 
+    /*
+     * Split the candidates into groups that don't share any lines, and
+     * search all but the last group concurrently. The groups get their
+     * own copies of the indexes, since ours live in a per-thread buffer
+     * that will be reused as soon as we return.
+     */
+    int ways = split_ways(indexes[count - 1] - indexes[0]);
+    int start = 0;
+    for (int i = 1; i < ways; i++) {
+        int split = max(start + 1, int(int64_t(count) * i / ways));
+        if (split >= count)
+            break;
+        uint32_t eol = line_end(chunk, indexes[split - 1]);
+        while (split < count && indexes[split] <= eol)
+            split++;
+        if (split >= count)
+            break;
+        auto part = std::make_shared<vector<uint32_t>>(indexes + start,
+                                                       indexes + split);
+        spawn_([this, part, chunk, exact] {
+                if (exact)
+                    search_literal(part->data(), part->size(), chunk);
+                else
+                    search_ranges(part->data(), part->size(), chunk);
+            });
+        start = split;
+    }
+
+    if (exact)
+        search_literal(indexes + start, count - start, chunk);
+    else
+        search_ranges(indexes + start, count - start, chunk);
+}
+
+/*
+ * Like search_ranges, but for sorted candidates that each start a
+ * possible occurrence of literal_. The leftmost occurrence on each
+ * line is exactly the match RE2 would have reported for it.
+ */
+void searcher::search_literal(const uint32_t *indexes, int count,
+                              const chunk *chunk)
+{
+    StringPiece str((char*)chunk->data, chunk->size);
+    size_t len = literal_.size();
+    uint32_t next = 0;
+    for (int i = 0; i < count && !limiter_.exit_early(); i++) {
+        uint32_t pos = indexes[i];
+        if (pos < next)
+            continue;
+        if (pos + len > chunk->size ||
+            memcmp(chunk->data + pos, literal_.data(), len) != 0)
+            continue;
+
+        StringPiece match(str.data() + pos, len);
+        StringPiece line = find_line(str, match);
+        if (utf8::is_valid(line.data(), line.data() + line.size()))
+            find_match(chunk, match, line);
+        next = line.size() + line.data() - str.data() + 1;
+    }
+}
+
+void searcher::search_ranges(const uint32_t *indexes, int count,
+                             const chunk *chunk)
+{
     match_finger finger(chunk);
 
     StringPiece search((char*)chunk->data, chunk->size);
@@ -819,8 +1619,21 @@ void searcher::search_lines(uint32_t *indexes, int count,
 
 void searcher::full_search(const chunk *chunk)
 {
+    int ways = split_ways(chunk->size);
+    int start = 0, step = chunk->size / ways;
+    for (int i = 1; i < ways; i++) {
+        int end = line_end(chunk, start + step);
+        if (end >= chunk->size - 1)
+            break;
+        spawn_([this, chunk, start, end] {
+                match_finger finger(chunk);
+                full_search(&finger, chunk, start, end);
+            });
+        start = end + 1;
+    }
+
     match_finger finger(chunk);
-    full_search(&finger, chunk, 0, chunk->size - 1);
+    full_search(&finger, chunk, start, chunk->size - 1);
 }
 
 void searcher::next_range(match_finger *finger,
@@ -836,7 +1649,7 @@ void searcher::next_range(match_finger *finger,
 
     /* Find the first matching range that intersects [pos, maxpos) */
     while (it != end &&
-           (it->right < pos || !accept(query_, it->files)) &&
+           (it->right < pos || !(*filter_)(finger->chunk_, *it)) &&
            it->left < maxpos)
         ++it;
 
@@ -857,7 +1670,7 @@ void searcher::next_range(match_finger *finger,
     do {
         if (it->left >= endpos + kMinSkip)
             break;
-        if (it->right >= endpos && accept(query_, it->files)) {
+        if (it->right >= endpos && (*filter_)(finger->chunk_, *it)) {
             endpos = max(endpos, it->right);
             if (endpos >= maxpos)
                 /*
@@ -876,8 +1689,11 @@ void searcher::full_search(match_finger *finger,
 {
     StringPiece str((char*)chunk->data, chunk->size);
     StringPiece match;
+    const RE2 &pat = line_pat();
     int pos = minpos, new_pos, end = minpos;
-    while (pos < maxpos && !limiter_.exit_early()) {
+    // A step can scan up to kMaxScan bytes, so check the limits on
+    // every one.
+    while (pos < maxpos && !limiter_.check()) {
         if (pos >= end) {
             end = maxpos;
             next_range(finger, pos, end, maxpos);
@@ -893,8 +1709,22 @@ void searcher::full_search(match_finger *finger,
             int limit = end;
             if (limit - pos > kMaxScan)
                 limit = line_end(chunk, pos + kMaxScan);
+            if (literals_) {
+                const char *hit = literals_->find(str.data() + pos,
+                                                  str.data() + limit);
+                if (hit == str.data() + limit) {
+                    pos = limit + 1;
+                    continue;
+                }
+                int off = hit - str.data();
+                int start = line_start(chunk, off);
+                if (chunk->data[start] == '\n')
+                    start++;
+                pos = max(pos, start);
+                limit = min(limit, line_end(chunk, off));
+            }
             run_timer run(re2_time_);
-            if (!query_->line_pat->Match(str, pos, limit, RE2::UNANCHORED, &match, 1)) {
+            if (!pat.Match(str, pos, limit, RE2::UNANCHORED, &match, 1)) {
                 pos = limit + 1;
                 continue;
             }
@@ -909,6 +1739,26 @@ void searcher::full_search(match_finger *finger,
     }
 }
 
+const RE2 &searcher::line_pat() {
+    int self = search_executor()->current_worker();
+    if (self < 0 || self >= int(line_pats_.size()))
+        return *query_->line_pat;
+
+    std::unique_ptr<RE2> &pat = line_pats_[self];
+    if (!pat) {
+        RE2::Options opts(query_->line_pat->options());
+        opts.set_max_mem(FLAGS_re2_thread_max_mem);
+        pat.reset(new RE2(query_->line_pat->pattern(), opts));
+        if (!pat->ok()) {
+            // The program may not fit in the per-thread budget; the
+            // query's own options are known to work.
+            pat.reset(new RE2(query_->line_pat->pattern(),
+                              query_->line_pat->options()));
+        }
+    }
+    return *pat;
+}
+
 void searcher::find_match_brute(const chunk *chunk,
                                 const StringPiece& match,
                                 const StringPiece& line) {
@@ -920,14 +1770,14 @@ void searcher::find_match_brute(const chunk *chunk,
     for(vector<chunk_file>::const_iterator it = chunk->files.begin();
         it != chunk->files.end(); it++) {
         if (off >= it->left && off <= it->right) {
-            for (list<indexed_file *>::const_iterator fit = it->files.begin();
-                 fit != it->files.end(); ++fit) {
-                if (!accept(query_, *fit))
+            for (const uint32_t *fit = chunk->begin_files(*it);
+                 fit != chunk->end_files(*it); ++fit) {
+                if (!(*filter_)(*fit))
                     continue;
                 searched++;
                 if (limiter_.exit_early())
                     break;
-                try_match(line, match, *fit);
+                try_match(chunk, line, match, cc_->files_[*fit].get());
             }
         }
     }
@@ -950,66 +1800,69 @@ void searcher::find_match(const chunk *chunk,
     run_timer run(git_time_);
     int loff = (unsigned char*)line.data() - chunk->data;
 
-    vector<chunk_file_node *> stack;
-    assert(chunk->cf_root);
-    stack.push_back(chunk->cf_root.get());
+    // Each stack entry is a [lo, hi) range of chunk->files, whose
+    // subtree is rooted at its midpoint.
+    pair<int, int> stack[64];
+    int depth = 0;
+    assert(!chunk->files.empty());
+    stack[depth++] = make_pair(0, int(chunk->files.size()));
 
     debug(kDebugSearch, "find_match(%d)", loff);
 
-    while (!stack.empty() && !limiter_.exit_early()) {
-        chunk_file_node *n = stack.back();
-        stack.pop_back();
+    while (depth && !limiter_.exit_early()) {
+        int lo = stack[depth - 1].first, hi = stack[depth - 1].second;
+        --depth;
+        if (lo == hi)
+            continue;
+        int mid = (lo + hi) / 2;
+        const chunk_file &cf = chunk->files[mid];
 
         debug(kDebugSearch,
-              "walk <%d-%d> - %d", n->chunk->left, n->chunk->right,
-              n->right_limit);
+              "walk <%d-%d> - %d", cf.left, cf.right,
+              chunk->right_limit[mid]);
 
-        if (loff > n->right_limit)
+        if (loff > chunk->right_limit[mid])
             continue;
-        if (loff >= n->chunk->left) {
-            if (n->right)
-                stack.push_back(n->right.get());
-            if (loff <= n->chunk->right) {
-                debug(kDebugSearch, "visit <%d-%d>", n->chunk->left, n->chunk->right);
-                assert(loff >= n->chunk->left && loff <= n->chunk->right);
-                for (list<indexed_file *>::const_iterator it = n->chunk->files.begin();
-                     it != n->chunk->files.end(); ++it) {
-                    if (!accept(query_, *it))
+        if (loff >= cf.left) {
+            stack[depth++] = make_pair(mid + 1, hi);
+            if (loff <= cf.right) {
+                debug(kDebugSearch, "visit <%d-%d>", cf.left, cf.right);
+                for (const uint32_t *it = chunk->begin_files(cf);
+                     it != chunk->end_files(cf); ++it) {
+                    if (!(*filter_)(*it))
                         continue;
                     if (limiter_.exit_early())
                         break;
-                    try_match(line, match, *it);
+                    try_match(chunk, line, match, cc_->files_[*it].get());
                 }
             }
         }
-        if (n->left)
-            stack.push_back(n->left.get());
+        stack[depth++] = make_pair(lo, mid);
     }
 }
 
 
-void searcher::try_match(const StringPiece& line,
+void searcher::try_match(const chunk *chunk,
+                         const StringPiece& line,
                          const StringPiece& match,
                          indexed_file *sf) {
-
-    int lno = 1;
-    auto it = sf->content->begin(cc_->alloc_.get());
-
-    while (true) {
-        for (;it != sf->content->end(cc_->alloc_.get()); ++it) {
-            if (line.data() >= it->data() &&
-                line.data() <= it->data() + it->size()) {
-                break;
-            } else {
-                lno += 1;
-            }
-        }
+    // Called for every matching line, so reuse one buffer per thread.
+    static per_thread<vector<uint32_t> > scratch;
+    if (!scratch.get())
+        scratch.put(new vector<uint32_t>);
+    vector<uint32_t> &hits = *scratch;
+    hits.clear();
+    sf->content->lookup(chunk->id,
+                        reinterpret_cast<const unsigned char*>(line.data()) - chunk->data,
+                        &hits);
+
+    for (auto hit = hits.begin(); hit != hits.end(); ++hit) {
+        auto it = sf->content->at(cc_->alloc_.get(), *hit);
+        int lno = sf->content->get(*hit).line +
+            std::count(it->data(), line.data(), '\n');
 
         debug(kDebugSearch, "found match on %s:%d", sf->path.c_str(), lno);
 
-        if (it == sf->content->end(cc_->alloc_.get()))
-            return;
-
         match_result *m = new match_result;
         m->file = sf;
         m->lno  = lno;
@@ -1052,20 +1905,11 @@ void searcher::try_match(const StringPiece& line,
         }
         if (limiter_.exit_early())
             break;
-
-        ++it;
-        ++lno;
     }
 }
 
 code_searcher::search_thread::search_thread(code_searcher *cs)
     : cs_(cs) {
-    if (FLAGS_search) {
-        for (int i = 0; i < FLAGS_threads; ++i) {
-            threads_.emplace_back(search_one, this);
-        }
-        threads_.emplace_back(search_file_one, this);
-    }
 }
 
 void code_searcher::search_thread::match(const query &q,
@@ -1089,41 +1933,64 @@ void code_searcher::search_thread::match(const query &q,
 
     timer analyze_time(false);
     intrusive_ptr<QueryPlan> index_key;
+    std::unique_ptr<file_filter> filter;
     {
         run_timer run(analyze_time);
-        index_key = constructQueryPlan(*q.line_pat);
+        index_key = query_cache::shared()->plan(q.line_pat, &cs_->stats(),
+                                                cs_->generation());
+        filter.reset(new file_filter(cs_, &q));
     }
     debug(kDebugProfile, "analyze time: %d.%06ds",
           int(analyze_time.elapsed().tv_sec),
           int(analyze_time.elapsed().tv_usec));
 
-    searcher search(cs_, q, index_key, func);
-    filename_searcher file_search(cs_, q, index_key);
+    executor *exec = search_executor();
+    searcher search(cs_, q, index_key, filter.get(), func);
+    filename_searcher file_search(cs_, q, index_key, filter.get());
     job j;
     j.trace_id = current_trace_id();
     j.search = &search;
     j.file_search = &file_search;
     j.pending = 0;
+    j.next_chunk = 0;
+    j.parked = 0;
+    j.max_queued = q.max_pending ? q.max_pending : kMaxQueuedMatches;
 
     if (!q.filename_only) {
-        for (int i = 0; i < FLAGS_threads; ++i) {
-            ++j.pending;
-            queue_.push(&j);
+        for (auto it = cs_->alloc_->begin(); it != cs_->alloc_->end(); it++) {
+            j.chunks.push_back(*it);
         }
 
-        for (auto it = cs_->alloc_->begin(); it != cs_->alloc_->end(); it++) {
-            j.chunks.push(*it);
+        // With fewer chunks than workers, let each chunk be split so
+        // that the whole executor can work on this query.
+        if (!j.chunks.empty() && int(j.chunks.size()) < exec->size()) {
+            search.set_spawn([exec, &j](const std::function<void ()>& fn) {
+                    ++j.pending;
+                    exec->submit([&j, fn] {
+                            scoped_trace_id trace(j.trace_id);
+                            fn();
+                            finish_one(&j);
+                        });
+                }, exec->size() / j.chunks.size());
+        }
+
+        int width = min(exec->size(), int(j.chunks.size()));
+        if (width == 0)
+            search.queue_.close();
+        j.pending = width;
+        for (int i = 0; i < width; ++i) {
+            exec->submit([&j] { search_chunks(&j); });
         }
-        j.chunks.close();
     }
 
-    file_queue_.push(&j);
+    exec->submit([&j] { search_files(&j); });
 
     if (!q.filename_only) {
         while (search.queue_.pop(&m)) {
             matches++;
             cb(m);
             delete m;
+            resume_parked(&j);
         }
     }
 
@@ -1148,34 +2015,91 @@ void code_searcher::search_thread::match(const query &q,
 
 
 code_searcher::search_thread::~search_thread() {
-    queue_.close();
-    file_queue_.close();
-    for (auto it = threads_.begin(); it != threads_.end(); ++it)
-        it->join();
 }
 
-void code_searcher::search_thread::search_one(search_thread *me) {
-    job *j;
-    while (me->queue_.pop(&j)) {
-        scoped_trace_id trace(j->trace_id);
+void code_searcher::search_thread::search_chunks(job *j) {
+    scoped_trace_id trace(j->trace_id);
 
-        chunk *c;
-        while (j->chunks.pop(&c)) {
-            (*j->search)(c);
+    {
+        std::unique_lock<std::mutex> locked(j->mtx);
+        if (j->search->queue_.size() >= j->max_queued) {
+            j->parked++;
+            return;
         }
+    }
 
-        if (--j->pending == 0)
-            j->search->queue_.close();
+    int i = j->next_chunk++;
+    if (i < int(j->chunks.size())) {
+        (*j->search)(j->chunks[i]);
+        search_executor()->submit([j] { search_chunks(j); });
+        return;
     }
+
+    finish_one(j);
 }
 
-void code_searcher::search_thread::search_file_one(search_thread *me) {
-    job *j;
-    while (me->file_queue_.pop(&j)) {
-        scoped_trace_id trace(j->trace_id);
-        (*j->file_search)();
-        j->file_search->queue_.close();
+/*
+ * Called by the consumer after each match it takes. A task parks only
+ * while the queue is over the limit, and we check again after every
+ * pop, so a parked task is always seen before the queue runs dry.
+ */
+void code_searcher::search_thread::resume_parked(job *j) {
+    int n;
+    {
+        std::unique_lock<std::mutex> locked(j->mtx);
+        if (j->parked == 0 ||
+            j->search->queue_.size() > j->max_queued / 2)
+            return;
+        n = j->parked;
+        j->parked = 0;
     }
+    while (n--)
+        search_executor()->submit([j] { search_chunks(j); });
+}
+
+void code_searcher::search_thread::finish_one(job *j) {
+    if (--j->pending == 0)
+        j->search->queue_.close();
+}
+
+void code_searcher::search_thread::search_files(job *j) {
+    scoped_trace_id trace(j->trace_id);
+    (*j->file_search)();
+    j->file_search->queue_.close();
+}
+
+std::shared_ptr<candidate_set> candidate_set::for_pattern(const RE2 &pat) {
+    if (!plain_literal(pat.pattern()))
+        return nullptr;
+    return std::shared_ptr<candidate_set>(
+        new candidate_set(pat.pattern(), pat.options().case_sensitive()));
+}
+
+bool candidate_set::refined_by(const RE2 &pat) const {
+    if (!plain_literal(pat.pattern()))
+        return false;
+    if (case_sensitive_)
+        return pat.options().case_sensitive() &&
+            pat.pattern().find(literal_) != string::npos;
+    // Our candidates include every case-folding of the literal, so
+    // they cover a refinement in either case.
+    return ascii_lower(pat.pattern()).find(ascii_lower(literal_)) != string::npos;
+}
+
+std::shared_ptr<const vector<uint32_t>> candidate_set::get(const chunk *c) {
+    std::unique_lock<std::mutex> locked(mtx_);
+    auto it = chunks_.find(c);
+    if (it == chunks_.end())
+        return nullptr;
+    return it->second;
+}
+
+void candidate_set::put(const chunk *c, const uint32_t *indexes, int count) {
+    std::unique_lock<std::mutex> locked(mtx_);
+    if (total_ + count > kMaxSetCandidates || chunks_.count(c))
+        return;
+    chunks_[c] = std::make_shared<const vector<uint32_t>>(indexes, indexes + count);
+    total_ += count;
 }
 
 void default_re2_options(RE2::Options &opts) {
@@ -28,8 +28,11 @@
 
 class searcher;
 class filename_searcher;
+class file_filter;
 class chunk_allocator;
 class file_contents;
+class corpus_stats;
+class QueryPlan;
 struct match_result;
 
 using re2::RE2;
@@ -50,6 +53,7 @@ enum exit_reason {
     kExitNone = 0,
     kExitTimeout,
     kExitMatchLimit,
+    kExitCancelled,
 };
 
 
@@ -106,6 +110,39 @@ struct file_result {
     int matchleft, matchright;
 };
 
+/*
+ * The suffix-array candidates that a search for a plain literal found
+ * in each chunk. A later search whose line pattern can only match
+ * lines containing that literal -- the next keystroke of a type-ahead
+ * search, say -- searches just those candidates instead of consulting
+ * the suffix array again.
+ *
+ * Chunks the earlier search never reached, or that had too many
+ * candidates to keep, are searched as usual.
+ */
+class candidate_set {
+public:
+    // Returns an empty set to record a search for `pat' into, or
+    // nullptr if `pat' is not a plain literal.
+    static std::shared_ptr<candidate_set> for_pattern(const RE2 &pat);
+
+    // Does every line `pat' can match contain our literal?
+    bool refined_by(const RE2 &pat) const;
+
+    std::shared_ptr<const vector<uint32_t>> get(const chunk *c);
+    void put(const chunk *c, const uint32_t *indexes, int count);
+
+protected:
+    candidate_set(const string &literal, bool case_sensitive)
+        : literal_(literal), case_sensitive_(case_sensitive), total_(0) {}
+
+    string literal_;
+    bool case_sensitive_;
+    std::mutex mtx_;
+    std::map<const chunk*, std::shared_ptr<const vector<uint32_t>>> chunks_;
+    size_t total_;
+};
+
 // A query specification passed to match(). line_pat is required to be
 // non-NULL; file_pat, tree_pat and tag_pat may be NULL to specify "no
 // constraint"
@@ -125,21 +162,57 @@ struct query {
 
     bool filename_only;
     int context_lines;
+
+    // The search gives up with kExitTimeout at this absolute time, or
+    // at --timeout if that comes first. Zero means no deadline of its
+    // own.
+    timeval deadline = {0, 0};
+    // If set, polled periodically while searching; once it returns
+    // true the search stops with kExitCancelled.
+    std::function<bool ()> cancelled;
+    // If nonzero, chunk tasks park once this many matches are waiting
+    // to be consumed, instead of at the default backlog. Streaming
+    // searches use this to bound what they buffer for a slow client.
+    size_t max_pending = 0;
+
+    // Candidates from an earlier search that this one refines, and a
+    // set to record this search's own candidates into. Either may be
+    // NULL.
+    std::shared_ptr<candidate_set> refine;
+    std::shared_ptr<candidate_set> record;
+};
+
+/*
+ * Where fs_indexer and git_indexer send the trees and files they walk:
+ * either straight into a code_searcher, or into an index_pipeline that
+ * indexes them in the background.
+ */
+class file_sink {
+public:
+    virtual ~file_sink() {}
+
+    virtual const indexed_tree *open_tree(const string &name, const Metadata &meta,
+                                          const string& version) = 0;
+    // `contents' need only live until this returns.
+    virtual void index_file(const indexed_tree *tree,
+                            const string& path,
+                            StringPiece contents) = 0;
 };
 
-class code_searcher {
+class code_searcher : public file_sink {
 public:
     code_searcher();
     ~code_searcher();
     void dump_index(const string& path);
     void load_index(const string& path);
 
-    const indexed_tree *open_tree(const string &name, const Metadata &meta, const string& version);
+    virtual const indexed_tree *open_tree(const string &name, const Metadata &meta,
+                                          const string& version);
     const indexed_tree *open_tree(const string &name, const string& version);
 
-    void index_file(const indexed_tree *tree,
-                    const string& path,
-                    StringPiece contents);
+    virtual void index_file(const indexed_tree *tree,
+                            const string& path,
+                            StringPiece contents);
     void finalize();
 
     void set_alloc(std::unique_ptr<chunk_allocator> alloc);
@@ -167,6 +240,26 @@ public:
         index_timestamp_ = index_timestamp;
     }
 
+    // Frequencies of the indexed text, for the query planner.
+    const corpus_stats &stats() const {
+        return *stats_;
+    }
+
+    // Identifies this index for caches of things derived from it, such
+    // as query plans. Unlike its address, it is never reused by a
+    // later code_searcher in the same process. Never 0.
+    uint64_t generation() const {
+        return generation_;
+    }
+
+    // The number of positions `plan' narrows a search of the index
+    // to, summed over every chunk.
+    long count_candidates(const boost::intrusive_ptr<QueryPlan> &plan) const;
+
+    // A handle for running queries against this code_searcher. The
+    // actual work is done on a process-wide executor shared by every
+    // search_thread, so these are cheap to create and any number of
+    // them may be matching concurrently.
     class search_thread {
     public:
         search_thread(code_searcher *cs);
@@ -193,27 +286,69 @@ public:
                    const transform_func& func,
                    match_stats *stats);
     protected:
+        // The chunks of a job are handed out one at a time. Each task
+        // searches a single chunk and then re-submits itself to the
+        // shared executor, so that concurrent queries interleave
+        // instead of one query holding every worker until it's done.
+        // `pending' counts the chunk tasks still running, plus any
+        // pieces of a chunk they've split off; the last one to finish
+        // closes the searcher's queue.
+        //
+        // If the caller falls behind on consuming matches, chunk tasks
+        // park themselves instead of starting on another chunk, and
+        // are resubmitted once the backlog has drained. `max_queued' is
+        // the backlog they park at; `parked' is protected by `mtx'.
         struct job {
             std::string trace_id;
             atomic_int pending;
             searcher *search;
             filename_searcher *file_search;
-            thread_queue<chunk*> chunks;
+            vector<chunk*> chunks;
+            atomic_int next_chunk;
+            std::mutex mtx;
+            int parked;
+            size_t max_queued;
         };
 
         const code_searcher *cs_;
-        vector<std::thread> threads_;
-        thread_queue<job*> queue_;
-        thread_queue<job*> file_queue_;
 
-        static void search_one(search_thread *);
-        static void search_file_one(search_thread *);
+        static void search_chunks(job *j);
+        static void finish_one(job *j);
+        static void resume_parked(job *j);
+        static void search_files(job *j);
     private:
         search_thread(const search_thread&);
         void operator=(const search_thread&);
     };
 
 protected:
+    /*
+     * A file on its way into the index. prepare_file() splits it into
+     * lines and hashes them, which needs nothing from the
+     * code_searcher and so can run on any thread; commit_file() then
+     * adds them to the index, and has to run on one thread at a time.
+     */
+    struct prepared_file {
+        struct line {
+            uint32_t off;
+            uint32_t len;
+            size_t hash;
+        };
+
+        const indexed_tree *tree;
+        string path;
+        StringPiece contents;
+        // Holds `contents', for a file that has to outlive the buffer
+        // it was read into.
+        string data;
+        // Whether the file holds a NUL, and so isn't indexed.
+        bool binary;
+        vector<line> lines;
+    };
+
+    static void prepare_file(prepared_file *file);
+    void commit_file(const prepared_file &file);
+
     string name_;
 
     // Transient structure used during index construction to dedup lines.
@@ -231,10 +366,18 @@ protected:
     // Timestamp representing the end of index construction.
     int64_t index_timestamp_;
 
+    uint64_t generation_;
+
+    // Gathered from each line as it is added to a chunk, or loaded
+    // with the index.
+    std::unique_ptr<corpus_stats> stats_;
+
     // Structures for fast filename search; somewhat similar to a single chunk.
     // Built from files_ at finalization, not serialized or anything like that.
     vector<unsigned char> filename_data_;
     vector<uint32_t> filename_suffixes_;
+    // The suffixes that begin a filename, in suffix array order.
+    vector<uint32_t> filename_line_starts_;
     // pairs (i, file), where file->path starts at filename_data_[i]
     vector<pair<int, indexed_file*>> filename_positions_;
 
@@ -247,9 +390,11 @@ private:
     friend class search_thread;
     friend class searcher;
     friend class filename_searcher;
+    friend class file_filter;
     friend class codesearch_index;
     friend class load_allocator;
     friend class tag_searcher;
+    friend class index_pipeline;
 };
 
 // dump_load.cc
@@ -8,22 +8,141 @@
 #include "src/content.h"
 #include "src/chunk.h"
 
+#include <algorithm>
+#include <string.h>
+
 void file_contents_builder::extend(chunk *c, const StringPiece &piece) {
-    pieces_.push_back(piece);
+    ++lines_;
+    if (!pieces_.empty()) {
+        // Lines that follow each other in the same chunk, separated
+        // only by their newline, extend the previous piece.
+        pending &last = pieces_.back();
+        if (last.c == c && last.nlines < kMaxPieceLines &&
+            last.data.data() + last.data.size() + 1 == piece.data()) {
+            last.data = StringPiece(last.data.data(),
+                                    piece.data() + piece.size() - last.data.data());
+            last.nlines++;
+            return;
+        }
+    }
+    pieces_.push_back((pending){c, piece, lines_, 1});
 }
 
 file_contents *file_contents_builder::build(chunk_allocator *alloc) {
-    size_t len = sizeof(uint32_t) * (1 + 3*pieces_.size());
+    size_t len = file_contents::bytes(pieces_.size());
     unsigned char *mem = alloc->alloc_content_data(len);
     if (mem == nullptr) return nullptr;
     file_contents *out = new(mem) file_contents(pieces_.size());
     for (int i = 0; i < pieces_.size(); i++) {
         const unsigned char *p = reinterpret_cast<const unsigned char*>
-            (pieces_[i].data());
-        chunk *chunk = alloc->chunk_from_string(p);
+            (pieces_[i].data.data());
+        chunk *chunk = pieces_[i].c;
         out->pieces_[i].chunk = chunk->id;
         out->pieces_[i].off   = p - chunk->data;
-        out->pieces_[i].len   = pieces_[i].size();
+        out->pieces_[i].len   = pieces_[i].data.size();
+        out->pieces_[i].line  = pieces_[i].line;
+        out->maxlen_ = std::max(out->maxlen_, out->pieces_[i].len);
     }
+
+    uint32_t *order = out->order();
+    const file_contents::piece *pieces = out->pieces_;
+    for (uint32_t i = 0; i < out->npieces_; i++)
+        order[i] = i;
+    std::sort(order, order + out->npieces_,
+              [pieces](uint32_t lhs, uint32_t rhs) {
+                  if (pieces[lhs].chunk != pieces[rhs].chunk)
+                      return pieces[lhs].chunk < pieces[rhs].chunk;
+                  if (pieces[lhs].off != pieces[rhs].off)
+                      return pieces[lhs].off < pieces[rhs].off;
+                  return lhs < rhs;
+              });
     return out;
 }
+
+file_contents::line_iterator file_contents::begin_lines(chunk_allocator *alloc,
+                                                        uint32_t lno) {
+    piece *it = std::upper_bound(begin(), end(), lno,
+                                 [](uint32_t lno, const piece &p) {
+                                     return lno < p.line;
+                                 });
+    if (it == begin())
+        return end_lines(alloc);
+    --it;
+    return line_iterator(alloc, it, end(), lno - it->line);
+}
+
+file_contents::line_iterator::line_iterator(chunk_allocator *alloc,
+                                            piece *it, piece *end,
+                                            uint32_t skip)
+    : alloc_(alloc), it_(it), end_(end) {
+    if (it_ == end_)
+        return;
+    StringPiece data = piece_data();
+    line_ = StringPiece(data.data(), 0);
+    while (true) {
+        const char *eol = static_cast<const char*>
+            (memchr(line_.data(), '\n', data.data() + data.size() - line_.data()));
+        if (eol == nullptr)
+            eol = data.data() + data.size();
+        line_ = StringPiece(line_.data(), eol - line_.data());
+        if (skip-- == 0)
+            break;
+        if (eol == data.data() + data.size()) {
+            // The piece holds fewer lines than we were asked to
+            // skip; this only happens past the end of the file.
+            it_ = end_;
+            line_ = StringPiece();
+            break;
+        }
+        line_ = StringPiece(eol + 1, 0);
+    }
+}
+
+StringPiece file_contents::line_iterator::piece_data() const {
+    return StringPiece(reinterpret_cast<char*>(alloc_->at(it_->chunk)->data + it_->off),
+                       it_->len);
+}
+
+file_contents::line_iterator &file_contents::line_iterator::operator++() {
+    if (it_ == end_)
+        return *this;
+    StringPiece data = piece_data();
+    const char *pend = data.data() + data.size();
+    if (line_.data() + line_.size() == pend) {
+        ++it_;
+        *this = line_iterator(alloc_, it_, end_, 0);
+        return *this;
+    }
+    const char *start = line_.data() + line_.size() + 1;
+    const char *eol = static_cast<const char*>(memchr(start, '\n', pend - start));
+    if (eol == nullptr)
+        eol = pend;
+    line_ = StringPiece(start, eol - start);
+    return *this;
+}
+
+void file_contents::lookup(uint32_t chunk, uint32_t off,
+                           vector<uint32_t> *out) const {
+    const uint32_t *order = this->order();
+    const piece *pieces = pieces_;
+
+    // Find the first piece that starts after `off', and walk back
+    // over every piece that could still reach it.
+    const uint32_t *it = std::upper_bound(
+        order, order + npieces_, std::make_pair(chunk, off),
+        [pieces](const std::pair<uint32_t, uint32_t> &key, uint32_t i) {
+            if (key.first != pieces[i].chunk)
+                return key.first < pieces[i].chunk;
+            return key.second < pieces[i].off;
+        });
+
+    size_t start = out->size();
+    while (it != order) {
+        const piece &p = pieces[*--it];
+        if (p.chunk != chunk || off - p.off > maxlen_)
+            break;
+        if (off <= p.off + p.len)
+            out->push_back(*it);
+    }
+    std::sort(out->begin() + start, out->end());
+}
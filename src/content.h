@@ -18,12 +18,22 @@ using re2::StringPiece;
 using std::vector;
 
 
+// The most lines file_contents_builder will merge into a single piece.
+// This bounds the scan needed to find a line number within a piece.
+const uint32_t kMaxPieceLines = 64;
+
+/*
+ * A file's contents, as a list of pieces of chunk data. Each piece
+ * holds one or more consecutive lines of the file, separated by
+ * newlines, and records the line number of its first line.
+ */
 class file_contents {
 public:
     struct piece {
         uint32_t chunk;
         uint32_t off;
         uint32_t len;
+        uint32_t line;
     } __attribute__((packed));
 
     template <class T>
@@ -72,12 +82,59 @@ public:
         friend class file_contents;
     };
 
-    file_contents(uint32_t npieces) : npieces_(npieces) { }
+    // Iterates over a file's lines, rather than its pieces.
+    class line_iterator {
+    public:
+        const StringPiece &operator*() const {
+            return line_;
+        }
+
+        const StringPiece *operator->() const {
+            return &line_;
+        }
+
+        line_iterator &operator++();
+
+        bool operator==(const line_iterator &rhs) const {
+            return it_ == rhs.it_ && line_.data() == rhs.line_.data();
+        }
+        bool operator!=(const line_iterator &rhs) const {
+            return !(*this == rhs);
+        }
+    protected:
+        line_iterator(chunk_allocator *alloc, piece *it, piece *end, uint32_t skip);
+
+        StringPiece piece_data() const;
+
+        chunk_allocator *alloc_;
+        piece *it_, *end_;
+        StringPiece line_;
+
+        friend class file_contents;
+    };
+
+    file_contents(uint32_t npieces) : npieces_(npieces), maxlen_(0) { }
 
     iterator begin(chunk_allocator *alloc) {
         return iterator(alloc, pieces_);
     }
 
+    iterator at(chunk_allocator *alloc, uint32_t i) {
+        return iterator(alloc, pieces_ + i);
+    }
+
+    // Returns an iterator positioned at line `lno' (counting from 1),
+    // or end_lines() if the file is shorter than that.
+    line_iterator begin_lines(chunk_allocator *alloc, uint32_t lno = 1);
+
+    line_iterator end_lines(chunk_allocator *alloc) {
+        return line_iterator(alloc, end(), end(), 0);
+    }
+
+    const piece &get(uint32_t i) const {
+        return pieces_[i];
+    }
+
     iterator end(chunk_allocator *alloc) {
         return iterator(alloc, pieces_ + npieces_);
     }
@@ -94,6 +151,21 @@ public:
         return npieces_;
     }
 
+    // The number of bytes a file_contents with `npieces' pieces
+    // occupies in a content chunk.
+    static size_t bytes(uint32_t npieces) {
+        return sizeof(file_contents) + npieces * (sizeof(piece) + sizeof(uint32_t));
+    }
+
+    size_t bytes() const {
+        return bytes(npieces_);
+    }
+
+    // Appends to `out', in ascending order, the index of every piece
+    // that contains byte `off' of chunk `chunk' (counting the
+    // position just past the end of a piece).
+    void lookup(uint32_t chunk, uint32_t off, vector<uint32_t> *out) const;
+
     friend class codesearch_index;
     friend class load_allocator;
     friend class file_contents_builder;
@@ -101,16 +173,39 @@ public:
 protected:
     file_contents() {}
 
+    // The indexes of pieces_, sorted by (chunk, off), are stored
+    // immediately after pieces_.
+    uint32_t *order() {
+        return reinterpret_cast<uint32_t*>(pieces_ + npieces_);
+    }
+    const uint32_t *order() const {
+        return reinterpret_cast<const uint32_t*>(pieces_ + npieces_);
+    }
+
     uint32_t npieces_;
+    // The length of the longest piece, which bounds how far back from
+    // a given offset lookup() needs to look.
+    uint32_t maxlen_;
     piece pieces_[];
 };
 
 class file_contents_builder {
 public:
+    file_contents_builder() : lines_(0) {}
+
+    // Appends the next line of the file, which lives in `chunk'.
     void extend(chunk *chunk, const StringPiece &piece);
     file_contents *build(chunk_allocator *alloc);
 protected:
-    vector <StringPiece> pieces_;
+    struct pending {
+        chunk *c;
+        StringPiece data;
+        uint32_t line;
+        uint32_t nlines;
+    };
+
+    vector<pending> pieces_;
+    uint32_t lines_;
 };
 
 #endif
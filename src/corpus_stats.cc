@@ -0,0 +1,51 @@
+/********************************************************************
+ * livegrep -- corpus_stats.cc
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#include "src/corpus_stats.h"
+
+#include <algorithm>
+#include <type_traits>
+
+static_assert(std::is_trivially_copyable<corpus_stats>::value,
+              "corpus_stats is dumped to the index byte-for-byte");
+
+corpus_stats::corpus_stats()
+    : bytes_(0), lines_(0), unigrams_(), bigrams_(), trigrams_() {
+}
+
+void corpus_stats::add(const unsigned char *p, size_t len) {
+    bytes_ += len;
+    for (size_t i = 0; i < len; i++) {
+        unigrams_[p[i]]++;
+        if (p[i] == '\n')
+            lines_++;
+        if (i >= 1)
+            bigrams_[(p[i-1] << 8) | p[i]]++;
+        if (i >= 2)
+            trigrams_[trigram_bucket(p[i-2], p[i-1], p[i])]++;
+    }
+}
+
+double corpus_stats::line_length() const {
+    return double(bytes_) / std::max(lines_, uint64_t(1));
+}
+
+double corpus_stats::unigram(unsigned char a) const {
+    return (unigrams_[a] + 1.) / (bytes_ + 256.);
+}
+
+double corpus_stats::bigram(unsigned char a, unsigned char b) const {
+    return (bigrams_[(a << 8) | b] + unigram(b)) / (unigrams_[a] + 1.);
+}
+
+double corpus_stats::trigram(unsigned char a, unsigned char b,
+                             unsigned char c) const {
+    uint64_t ab = bigrams_[(a << 8) | b];
+    uint64_t abc = std::min(trigrams_[trigram_bucket(a, b, c)],
+                            std::min(ab, bigrams_[(b << 8) | c]));
+    return (abc + bigram(b, c)) / (ab + 1.);
+}
@@ -0,0 +1,71 @@
+/********************************************************************
+ * livegrep -- corpus_stats.h
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#ifndef CODESEARCH_CORPUS_STATS_H
+#define CODESEARCH_CORPUS_STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Byte, bigram and trigram frequencies of the (deduplicated) line data
+ * in an index, gathered as lines are indexed. The query planner uses
+ * these in place of its assumption that text is random printable
+ * ASCII, so that it can tell a rare token from a common one.
+ *
+ * Trigrams are counted in a fixed-size hash table; a collision can
+ * only make a trigram look more common than it is.
+ *
+ * corpus_stats is stored in the index file as-is, and so must stay
+ * trivially copyable.
+ */
+class corpus_stats {
+public:
+    static const int kTrigramBuckets = 1 << 16;
+
+    corpus_stats();
+
+    void add(const unsigned char *p, size_t len);
+
+    bool empty() const {
+        return bytes_ == 0;
+    }
+    uint64_t bytes() const {
+        return bytes_;
+    }
+    uint64_t lines() const {
+        return lines_;
+    }
+    // The mean length of an indexed line, including its newline.
+    double line_length() const;
+
+    /*
+     * Estimated probabilities, smoothed so that a sequence that never
+     * occurs still gets a small nonzero chance:
+     *   unigram(a)        = P(a)
+     *   bigram(a, b)      = P(b | a)
+     *   trigram(a, b, c)  = P(c | a b)
+     */
+    double unigram(unsigned char a) const;
+    double bigram(unsigned char a, unsigned char b) const;
+    double trigram(unsigned char a, unsigned char b, unsigned char c) const;
+
+protected:
+    static uint32_t trigram_bucket(unsigned char a, unsigned char b,
+                                   unsigned char c) {
+        uint32_t key = (uint32_t(a) << 16) | (uint32_t(b) << 8) | c;
+        return (key * 2654435761u) >> 16;
+    }
+
+    uint64_t bytes_;
+    uint64_t lines_;
+    uint64_t unigrams_[256];
+    uint64_t bigrams_[256 * 256];
+    uint64_t trigrams_[kTrigramBuckets];
+};
+
+#endif /* CODESEARCH_CORPUS_STATS_H */
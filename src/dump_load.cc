@@ -9,6 +9,7 @@
 #include "src/chunk.h"
 #include "src/chunk_allocator.h"
 #include "src/content.h"
+#include "src/corpus_stats.h"
 #include "src/dump_load.h"
 #include "src/lib/debug.h"
 
@@ -29,6 +30,45 @@
 
 DEFINE_bool(eager_memory_load, false, "Eagerly load memory-mapped index file pages into virtual memory (Linux only)");
 
+// Each chunk occupies this many bytes of the index file: its data,
+// then its suffix array, then its prefix bucket table, padded out to a
+// page boundary. In an FM-index index, its data is followed by its
+// fm_index instead; a sparse suffix array is stored elsewhere, and
+// leaves only the bucket table after the data. A trigram index is
+// stored elsewhere too, and leaves nothing.
+static size_t chunk_span(chunk_allocator *alloc) {
+    size_t chunk_size = alloc->chunk_size();
+    size_t len;
+    if (alloc->use_fm_index())
+        len = chunk_size + fm_index::bytes(chunk_size);
+    else if (alloc->use_trigram_index())
+        len = chunk_size;
+    else if (alloc->sparse_classes())
+        len = chunk_size + sizeof(uint32_t) * kPrefixBuckets;
+    else
+        len = (1 + sizeof(uint32_t)) * chunk_size + sizeof(uint32_t) * kPrefixBuckets;
+    return (len + kPageSize - 1) & ~size_t(kPageSize - 1);
+}
+
+// Builds the chunk for a chunk's span of the index file.
+static chunk *span_chunk(unsigned char *data, chunk_allocator *alloc) {
+    size_t chunk_size = alloc->chunk_size();
+    if (alloc->use_fm_index())
+        return new chunk(data, 0, 0, data + chunk_size);
+    if (alloc->use_trigram_index()) {
+        chunk *c = new chunk(data, 0, 0);
+        c->trigrams.enable();
+        return c;
+    }
+    if (alloc->sparse_classes())
+        return new chunk(data, 0,
+                         reinterpret_cast<uint32_t*>(data + chunk_size),
+                         nullptr, alloc->sparse_classes());
+    return new chunk(data,
+                     reinterpret_cast<uint32_t*>(data + chunk_size),
+                     reinterpret_cast<uint32_t*>(data + (1 + sizeof(uint32_t)) * chunk_size));
+}
+
 class codesearch_index {
 public:
     codesearch_index(code_searcher *cs, string path) :
@@ -46,6 +86,12 @@ public:
         hdr_.magic      = kIndexMagic;
         hdr_.version    = kIndexVersion;
         hdr_.chunk_size = cs->alloc_->chunk_size();
+        hdr_.flags      = 0;
+        if (cs->alloc_->use_fm_index())
+            hdr_.flags |= kIndexFMIndex;
+        if (cs->alloc_->use_trigram_index())
+            hdr_.flags |= kIndexTrigrams;
+        hdr_.sparse     = cs->alloc_->sparse_classes();
     }
 
     ~codesearch_index() {
@@ -57,11 +103,12 @@ protected:
     void dump_chunk_data();
     void dump_metadata();
     void dump_file(map<const indexed_tree*, int>& ids, indexed_file *sf);
-    void dump_chunk_file(chunk_file *cf);
+    void dump_chunk_file(chunk *chunk, chunk_file *cf);
     void dump_chunk_files(chunk *, chunk_header *);
     void dump_chunk_data(chunk *);
     void dump_content_data();
     void dump_filename_index();
+    void dump_stats();
 
     void alignp(uint32_t align) {
         streampos pos = stream_.tellp();
@@ -127,16 +174,15 @@ public:
     }
 
     virtual chunk *alloc_chunk() {
-        auto alloc = alloc_mmap((1 + sizeof(uint32_t)) * chunk_size_);
+        auto alloc = alloc_mmap(chunk_span(this));
 
         chunk_header chdr = {
             uint64_t(alloc.first)
         };
         index_->chunks_.push_back(chdr);
 
-        return new chunk(static_cast<unsigned char*>(alloc.second),
-                         reinterpret_cast<uint32_t*>
-                         (static_cast<unsigned char*>(alloc.second) + chunk_size_));
+        unsigned char *data = static_cast<unsigned char*>(alloc.second);
+        return span_chunk(data, this);
     }
 
     virtual buffer alloc_content_chunk() {
@@ -152,8 +198,8 @@ public:
         return b;
     }
 
-    virtual void finalize() {
-        chunk_allocator::finalize();
+    virtual void finalize(const vector<std::unique_ptr<indexed_file>> &files) {
+        chunk_allocator::finalize(files);
         auto cit = index_->content_.begin();
         for (auto ait = begin_content();
              ait != end_content(); ++ait, ++cit) {
@@ -161,13 +207,14 @@ public:
         }
         index_->dump_metadata();
         index_->dump_filename_index();
+        index_->dump_stats();
         index_->stream_.seekp(0);
         index_->dump(&index_->hdr_);
         index_->stream_.close();
     }
 
     virtual void free_chunk(chunk *chunk) {
-        munmap(chunk->data, 5*chunk_size_);
+        munmap(chunk->data, chunk_span(this));
         delete chunk;
     }
 protected:
@@ -200,11 +247,14 @@ public:
     virtual void drop_caches() {
         for (auto it = begin(); it != end(); ++it) {
             madvise((*it)->data, (*it)->size, MADV_DONTNEED);
-            madvise((*it)->suffixes, (*it)->size * sizeof(*(*it)->suffixes), MADV_DONTNEED);
+            if ((*it)->suffixes)
+                madvise((*it)->suffixes, (*it)->nsuffixes * sizeof(*(*it)->suffixes), MADV_DONTNEED);
+            else if ((*it)->fm.enabled())
+                madvise((*it)->data + chunk_size_, fm_index::bytes((*it)->size), MADV_DONTNEED);
         }
 #ifdef POSIX_FADV_DONTNEED
         posix_fadvise(fd_, hdr_->chunks_off,
-                      chunks_.size() * chunk_size_ * (1 + sizeof(uint32_t)),
+                      chunks_.size() * chunk_span(this),
                       POSIX_FADV_DONTNEED);
 #endif
     }
@@ -261,11 +311,11 @@ void codesearch_index::dump_file(map<const indexed_tree*, int>& ids, indexed_fil
     dump_string(sf->path);
 }
 
-void codesearch_index::dump_chunk_file(chunk_file *cf) {
-    dump_int32(cf->files.size());
-    for (list<indexed_file*>::iterator it = cf->files.begin();
-         it != cf->files.end(); ++it)
-        dump_int32((*it)->no);
+void codesearch_index::dump_chunk_file(chunk *chunk, chunk_file *cf) {
+    dump_int32(cf->nfiles);
+    for (const uint32_t *it = chunk->begin_files(*cf);
+         it != chunk->end_files(*cf); ++it)
+        dump_int32(*it);
 
     dump_int32(cf->left);
     dump_int32(cf->right);
@@ -278,7 +328,28 @@ void codesearch_index::dump_chunk_files(chunk *chunk, chunk_header *hdr) {
 
     for (vector<chunk_file>::iterator it = chunk->files.begin();
          it != chunk->files.end(); it ++)
-        dump_chunk_file(&(*it));
+        dump_chunk_file(chunk, &(*it));
+
+    alignp(sizeof(uint32_t));
+    hdr->lines_off = stream_.tellp();
+    hdr->nlines = chunk->nline_starts;
+    if (chunk->nline_starts)
+        stream_.write(reinterpret_cast<const char*>(chunk->line_starts),
+                      chunk->nline_starts * sizeof(uint32_t));
+
+    hdr->suffixes_off = stream_.tellp();
+    hdr->nsuffixes = 0;
+    if (chunk->sparse) {
+        hdr->nsuffixes = chunk->nsuffixes;
+        stream_.write(reinterpret_cast<const char*>(chunk->suffixes),
+                      chunk->nsuffixes * sizeof(uint32_t));
+    }
+
+    hdr->trigrams_off = stream_.tellp();
+    hdr->ntrigram_bytes = chunk->trigrams.bytes();
+    if (chunk->trigrams.enabled())
+        stream_.write(reinterpret_cast<const char*>(chunk->trigrams.storage()),
+                      chunk->trigrams.bytes());
 }
 
 void codesearch_index::dump_chunk_data(chunk *chunk) {
@@ -290,14 +361,35 @@ void codesearch_index::dump_chunk_data(chunk *chunk) {
     chdr.size = chunk->size;
     chunks_.push_back(chdr);
 
-    int err = ftruncate(fd_, off + 5 * hdr_.chunk_size);
+    bool fm = hdr_.flags & kIndexFMIndex;
+    size_t span = chunk_span(cs_->alloc_.get());
+    int err = ftruncate(fd_, off + span);
     if (err != 0) {
         die("ftruncate");
     }
     stream_.write(reinterpret_cast<char*>(chunk->data), hdr_.chunk_size);
+    if (fm) {
+        stream_.write(reinterpret_cast<const char*>(chunk->fm.storage()),
+                      fm_index::bytes(chunk->size));
+        stream_.seekp(off + span);
+        return;
+    }
+    if (hdr_.flags & kIndexTrigrams) {
+        stream_.seekp(off + span);
+        return;
+    }
+    if (hdr_.sparse) {
+        stream_.write(reinterpret_cast<char*>(chunk->buckets),
+                      sizeof(uint32_t) * kPrefixBuckets);
+        stream_.seekp(off + span);
+        return;
+    }
     stream_.write(reinterpret_cast<char*>(chunk->suffixes),
                   sizeof(uint32_t) * chunk->size);
-    stream_.seekp(off + 5 * hdr_.chunk_size);
+    stream_.seekp(off + (1 + sizeof(uint32_t)) * hdr_.chunk_size);
+    stream_.write(reinterpret_cast<char*>(chunk->buckets),
+                  sizeof(uint32_t) * kPrefixBuckets);
+    stream_.seekp(off + span);
 }
 
 void codesearch_index::dump_metadata() {
@@ -392,6 +484,12 @@ void codesearch_index::dump_filename_index() {
     }
 }
 
+void codesearch_index::dump_stats() {
+    hdr_.stats_off = stream_.tellp();
+    stream_.write(reinterpret_cast<const char*>(&cs_->stats()),
+                  sizeof(corpus_stats));
+}
+
 void codesearch_index::dump() {
     assert(cs_->finalized_);
 
@@ -401,6 +499,7 @@ void codesearch_index::dump() {
     dump_content_data();
     dump_metadata();
     dump_filename_index();
+    dump_stats();
 
     stream_.seekp(0);
     dump(&hdr_);
@@ -437,6 +536,9 @@ load_allocator::load_allocator(code_searcher *cs, const string& path) {
 
     hdr_ = consume<index_header>();
     set_chunk_size(hdr_->chunk_size);
+    set_use_fm_index(hdr_->flags & kIndexFMIndex);
+    set_use_trigram_index(hdr_->flags & kIndexTrigrams);
+    set_sparse_classes(hdr_->sparse);
     chunks_hdr_ = next_chunk_ = ptr<chunk_header>(hdr_->chunks_off);
     cs->set_index_timestamp((int64_t) hdr_->timestamp);
 
@@ -447,9 +549,7 @@ load_allocator::load_allocator(code_searcher *cs, const string& path) {
 
 chunk *load_allocator::alloc_chunk() {
     unsigned char *data = ptr<unsigned char>(next_chunk_->data_off);
-    uint32_t *indexes = reinterpret_cast<uint32_t*>(data + chunk_size_);
-
-    return new chunk(data, indexes);
+    return span_chunk(data, this);
 }
 
 unique_ptr<indexed_file> load_allocator::load_file(code_searcher *cs) {
@@ -466,19 +566,37 @@ void load_allocator::load_chunk(code_searcher *cs) {
 
     assert(next_chunk_->size <= hdr_->chunk_size);
     chunk->size = next_chunk_->size;
+    if (chunk->fm.enabled())
+        chunk->fm.load();
+    if (chunk->trigrams.enabled())
+        chunk->trigrams.load(ptr<uint8_t>(next_chunk_->trigrams_off),
+                             next_chunk_->ntrigram_bytes);
+    if (chunk->sparse) {
+        chunk->suffixes = ptr<uint32_t>(next_chunk_->suffixes_off);
+        chunk->nsuffixes = next_chunk_->nsuffixes;
+    } else {
+        chunk->nsuffixes = chunk->size;
+    }
 
     p_ = ptr<unsigned char>(next_chunk_->files_off);
 
     for (int i = 0; i < next_chunk_->nfiles; i++) {
         chunk->files.push_back(chunk_file());
         chunk_file &cf = chunk->files.back();
-        uint32_t nfiles = load_int32();
-        for (int j = 0; j < nfiles; j++)
-            cf.files.push_back(cs->files_[load_int32()].get());
+        cf.nfiles = load_int32();
+        cf.first = chunk->file_ids.size();
+        for (int j = 0; j < cf.nfiles; j++) {
+            uint32_t id = load_int32();
+            chunk->file_ids.push_back(id);
+            chunk->tree_names.insert(cs->files_[id]->tree->name);
+        }
         cf.left  = load_int32();
         cf.right = load_int32();
     }
-    chunk->build_tree_names();
+    if (next_chunk_->nlines) {
+        chunk->line_starts = ptr<uint32_t>(next_chunk_->lines_off);
+        chunk->nline_starts = next_chunk_->nlines;
+    }
     chunk->build_tree();
     ++next_chunk_;
 }
@@ -533,7 +651,7 @@ void load_allocator::load(code_searcher *cs) {
         b.data = p_;
         while (p_ < ptr<uint8_t>(chdr->file_off + chdr->size)) {
             (*it)->content = new(p_) file_contents;
-            p_ = reinterpret_cast<uint8_t*>((*it)->content->end());
+            p_ += (*it)->content->bytes();
             ++it;
         }
         b.end = p_;
@@ -562,6 +680,12 @@ void load_allocator::load(code_searcher *cs) {
         indexed_file *sf = it->get();
         cs->filename_positions_.push_back(make_pair(pos, sf));
     }
+    find_line_starts(cs->filename_data_.data(), cs->filename_suffixes_.data(),
+                     cs->filename_data_.size(), '\0',
+                     &cs->filename_line_starts_);
+
+    memcpy(cs->stats_.get(), ptr<corpus_stats>(hdr_->stats_off),
+           sizeof(corpus_stats));
 
     cs->finalized_ = true;
 }
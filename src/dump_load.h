@@ -11,17 +11,31 @@
 #include <stdint.h>
 
 const uint32_t kIndexMagic   = 0xc0d35eac;
-const uint32_t kIndexVersion = 16;
+const uint32_t kIndexVersion = 24;
 
 // 16k is the page size on Apple M1 macs, which is the largest page
 // size of supported platforms. We use a consistent page size
 // everywhere for simplicity
 const uint32_t kPageSize     = (1 << 14);
 
+// index_header.flags
+enum {
+    // Each chunk's data is followed by an fm_index, rather than by a
+    // suffix array and prefix bucket table.
+    kIndexFMIndex = 0x01,
+    // Each chunk is indexed by trigram posting lists, stored with its
+    // file map, and its data is followed by nothing.
+    kIndexTrigrams = 0x02,
+};
+
 struct index_header {
     uint32_t magic;
     uint32_t version;
     uint32_t chunk_size;
+    uint32_t flags;
+    // The token classes (kTokenIdent, ...) whose starts each chunk's
+    // sparse suffix array holds; 0 if they hold every suffix.
+    uint32_t sparse;
     uint64_t timestamp;
 
     uint64_t name_off;
@@ -42,6 +56,8 @@ struct index_header {
     uint64_t filedata_off;
     uint64_t filesuffixes_off;
     uint64_t filepos_off;
+
+    uint64_t stats_off;
 } __attribute__((packed));
 
 struct chunk_header {
@@ -49,6 +65,15 @@ struct chunk_header {
     uint64_t files_off;
     uint32_t size;
     uint32_t nfiles;
+    uint64_t lines_off;
+    uint32_t nlines;
+    // A sparse suffix array is stored here, rather than after the
+    // chunk's data.
+    uint64_t suffixes_off;
+    uint32_t nsuffixes;
+    // Likewise a trigram index, after that.
+    uint64_t trigrams_off;
+    uint64_t ntrigram_bytes;
 } __attribute__((packed));
 
 struct content_chunk_header {
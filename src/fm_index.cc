@@ -0,0 +1,238 @@
+/********************************************************************
+ * livegrep -- fm_index.cc
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#include "src/fm_index.h"
+
+#include "divsufsort.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <assert.h>
+#include <string.h>
+
+struct fm_index::header {
+    uint32_t size;
+    // The row whose suffix is the whole reversed text, and so has no
+    // preceding byte. Its symbol in the transform is stored as a 0.
+    uint32_t dollar;
+    // The number of clear bits in each level of the wavelet matrix.
+    uint32_t zeros[8];
+    // counts[c] is the first row whose suffix begins with byte c. Row
+    // 0 is the empty suffix.
+    uint32_t counts[257];
+    // Where the run of each byte begins in the wavelet matrix's last
+    // level.
+    uint32_t bottom[256];
+};
+
+static size_t align8(size_t n) {
+    return (n + 7) & ~size_t(7);
+}
+
+static uint32_t nwords(uint32_t nbits) {
+    return (size_t(nbits) + 63) / 64;
+}
+
+// One count for every four words, and one more for the end.
+static size_t rank_bytes(uint32_t nbits) {
+    return align8(sizeof(uint32_t) * ((nwords(nbits) >> 2) + 1));
+}
+
+size_t fm_index::bitvector::bytes(uint32_t nbits) {
+    return rank_bytes(nbits) + sizeof(uint64_t) * nwords(nbits);
+}
+
+void fm_index::bitvector::init(uint8_t *p, uint32_t nbits) {
+    ranks = reinterpret_cast<uint32_t*>(p);
+    bits = reinterpret_cast<uint64_t*>(p + rank_bytes(nbits));
+}
+
+void fm_index::bitvector::finish(uint32_t nbits) {
+    uint32_t nwords = ::nwords(nbits);
+    uint32_t count = 0;
+    for (uint32_t w = 0; w <= nwords; w++) {
+        if ((w & 3) == 0)
+            ranks[w >> 2] = count;
+        if (w < nwords)
+            count += __builtin_popcountll(bits[w]);
+    }
+}
+
+uint32_t fm_index::bitvector::rank(uint32_t i) const {
+    uint32_t count = ranks[i >> 8];
+    uint32_t w = (i >> 8) << 2, end = i >> 6;
+    for (; w < end; w++)
+        count += __builtin_popcountll(bits[w]);
+    if (i & 63)
+        count += __builtin_popcountll(bits[end] & ((uint64_t(1) << (i & 63)) - 1));
+    return count;
+}
+
+fm_index::fm_index(uint8_t *storage)
+    : storage_(storage), hdr_(nullptr), samples_(nullptr) {
+}
+
+size_t fm_index::bytes(uint32_t size) {
+    return align8(sizeof(header)) + 9 * bitvector::bytes(size + 1) +
+        sizeof(uint32_t) * (size / kSampleRate + 1);
+}
+
+void fm_index::layout() {
+    hdr_ = reinterpret_cast<const header*>(storage_);
+    uint32_t nrows = rows();
+    uint8_t *p = storage_ + align8(sizeof(header));
+    for (int l = 0; l < 8; l++) {
+        levels_[l].init(p, nrows);
+        p += bitvector::bytes(nrows);
+    }
+    sampled_.init(p, nrows);
+    p += bitvector::bytes(nrows);
+    samples_ = reinterpret_cast<uint32_t*>(p);
+}
+
+void fm_index::load() {
+    assert(storage_);
+    layout();
+}
+
+void fm_index::build(const unsigned char *data, uint32_t size) {
+    assert(storage_);
+    memset(storage_, 0, bytes(size));
+    header *hdr = reinterpret_cast<header*>(storage_);
+    hdr->size = size;
+    layout();
+    uint32_t nrows = rows();
+
+    std::vector<unsigned char> text(size);
+    std::reverse_copy(data, data + size, text.begin());
+
+    // The transform, and the samples of each row's position, in row
+    // order. divsufsort sorts a suffix before every longer one it is a
+    // prefix of, as though the text ended in a byte smaller than all
+    // the rest, so its rows follow row 0's empty suffix.
+    std::vector<unsigned char> bwt(nrows);
+    {
+        std::vector<saidx_t> sa(size);
+        if (size)
+            divsufsort(text.data(), sa.data(), size);
+        uint32_t nsamples = 0;
+        for (uint32_t row = 0; row < nrows; row++) {
+            uint32_t pos = row ? sa[row - 1] : size;
+            if (pos) {
+                bwt[row] = text[pos - 1];
+            } else {
+                bwt[row] = 0;
+                hdr->dollar = row;
+            }
+            if (pos % kSampleRate == 0) {
+                sampled_.set(row);
+                samples_[nsamples++] = pos;
+            }
+        }
+        sampled_.finish(nrows);
+    }
+
+    uint32_t freq[256] = {};
+    for (uint32_t i = 0; i < size; i++)
+        freq[data[i]]++;
+    hdr->counts[0] = 1;
+    for (int c = 0; c < 256; c++)
+        hdr->counts[c + 1] = hdr->counts[c] + freq[c];
+
+    // Each level of the wavelet matrix holds one bit of every symbol,
+    // most significant first, in the order the previous level leaves
+    // them: those with a clear bit, then those with a set one.
+    std::vector<unsigned char> next(nrows);
+    for (int l = 0; l < 8; l++) {
+        int shift = 7 - l;
+        uint32_t zeros = 0;
+        for (uint32_t i = 0; i < nrows; i++) {
+            if ((bwt[i] >> shift) & 1)
+                levels_[l].set(i);
+            else
+                zeros++;
+        }
+        levels_[l].finish(nrows);
+        hdr->zeros[l] = zeros;
+
+        uint32_t z = 0, o = zeros;
+        for (uint32_t i = 0; i < nrows; i++) {
+            if ((bwt[i] >> shift) & 1)
+                next[o++] = bwt[i];
+            else
+                next[z++] = bwt[i];
+        }
+        bwt.swap(next);
+    }
+
+    for (int c = 0; c < 256; c++) {
+        uint32_t i = 0;
+        for (int l = 0; l < 8; l++) {
+            if ((c >> (7 - l)) & 1)
+                i = hdr->zeros[l] + levels_[l].rank(i);
+            else
+                i -= levels_[l].rank(i);
+        }
+        hdr->bottom[c] = i;
+    }
+}
+
+uint32_t fm_index::rows() const {
+    return hdr_->size + 1;
+}
+
+// The number of times `c' occurs in the transform before row `i'.
+uint32_t fm_index::rank(unsigned char c, uint32_t i) const {
+    uint32_t end = i;
+    for (int l = 0; l < 8; l++) {
+        if ((c >> (7 - l)) & 1)
+            i = hdr_->zeros[l] + levels_[l].rank(i);
+        else
+            i -= levels_[l].rank(i);
+    }
+    i -= hdr_->bottom[c];
+    if (c == 0 && hdr_->dollar < end)
+        i--;
+    return i;
+}
+
+bool fm_index::extend(uint32_t *lo, uint32_t *hi, unsigned char c) const {
+    *lo = hdr_->counts[c] + rank(c, *lo);
+    *hi = hdr_->counts[c] + rank(c, *hi);
+    return *lo < *hi;
+}
+
+// The row of the suffix one byte longer than `row''s. Never called on
+// the dollar row, which is always sampled.
+uint32_t fm_index::lf(uint32_t row) const {
+    uint32_t i = row;
+    unsigned c = 0;
+    for (int l = 0; l < 8; l++) {
+        bool bit = levels_[l].get(i);
+        c = (c << 1) | bit;
+        if (bit)
+            i = hdr_->zeros[l] + levels_[l].rank(i);
+        else
+            i -= levels_[l].rank(i);
+    }
+    i -= hdr_->bottom[c];
+    if (c == 0 && hdr_->dollar < row)
+        i--;
+    return hdr_->counts[c] + i;
+}
+
+uint32_t fm_index::locate(uint32_t row, uint32_t depth) const {
+    uint32_t steps = 0;
+    while (!sampled_.get(row)) {
+        row = lf(row);
+        steps++;
+    }
+    uint32_t pos = samples_[sampled_.rank(row)] + steps;
+    assert(pos + depth <= hdr_->size);
+    return hdr_->size - depth - pos;
+}
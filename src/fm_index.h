@@ -0,0 +1,99 @@
+/********************************************************************
+ * livegrep -- fm_index.h
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#ifndef CODESEARCH_FM_INDEX_H
+#define CODESEARCH_FM_INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * An FM-index: a compressed stand-in for a chunk's suffix array that
+ * keeps its range-narrowing search. It takes a little over a byte per
+ * byte of text, against the four of a suffix array, at the cost of a
+ * slower step and a much slower lookup of each candidate's position.
+ *
+ * The index is built over the chunk's text reversed, so that the
+ * FM-index's backward search -- which grows a pattern one character
+ * to the left -- grows the original pattern one character to the
+ * right, just as a walk of the suffix array does. A range of rows
+ * stands for every occurrence of the pattern walked so far.
+ *
+ * The Burrows-Wheeler transform is kept as a wavelet matrix, and
+ * every kSampleRate'th position of the reversed text is sampled to
+ * find where a row's occurrence lies.
+ *
+ * An fm_index lives entirely in storage supplied by its owner, so
+ * that it can be written to and read from an index file in place.
+ */
+class fm_index {
+public:
+    static const uint32_t kSampleRate = 32;
+
+    explicit fm_index(uint8_t *storage = nullptr);
+
+    // The bytes of storage an index of `size' bytes of text needs.
+    static size_t bytes(uint32_t size);
+
+    // Whether this index has storage at all; a chunk without it is
+    // indexed with a suffix array instead.
+    bool enabled() const {
+        return storage_ != nullptr;
+    }
+
+    // Builds the index of data[0, size) into our storage.
+    void build(const unsigned char *data, uint32_t size);
+    // Uses an index that build() already left in our storage.
+    void load();
+
+    const uint8_t *storage() const {
+        return storage_;
+    }
+
+    // The rows of the index; [0, rows()) matches the empty pattern.
+    uint32_t rows() const;
+
+    // Narrows [*lo, *hi), the rows matching some pattern, to those
+    // matching that pattern followed by `c'. Returns whether any do.
+    bool extend(uint32_t *lo, uint32_t *hi, unsigned char c) const;
+
+    // The position in the text of the occurrence `row' stands for,
+    // where `depth' is the length of the pattern it matched.
+    uint32_t locate(uint32_t row, uint32_t depth) const;
+
+private:
+    struct header;
+
+    // A bit vector with a count of the set bits before every 256.
+    struct bitvector {
+        uint32_t *ranks;
+        uint64_t *bits;
+
+        static size_t bytes(uint32_t nbits);
+        void init(uint8_t *p, uint32_t nbits);
+        void finish(uint32_t nbits);
+        void set(uint32_t i) {
+            bits[i >> 6] |= uint64_t(1) << (i & 63);
+        }
+        bool get(uint32_t i) const {
+            return (bits[i >> 6] >> (i & 63)) & 1;
+        }
+        uint32_t rank(uint32_t i) const;
+    };
+
+    uint32_t rank(unsigned char c, uint32_t i) const;
+    uint32_t lf(uint32_t row) const;
+    void layout();
+
+    uint8_t *storage_;
+    const header *hdr_;
+    bitvector levels_[8];
+    bitvector sampled_;
+    uint32_t *samples_;
+};
+
+#endif /* CODESEARCH_FM_INDEX_H */
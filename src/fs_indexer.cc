@@ -14,13 +14,13 @@ static int kMaxRecursion = 100;
 using namespace std;
 namespace fs = boost::filesystem;
 
-fs_indexer::fs_indexer(code_searcher *cs,
+fs_indexer::fs_indexer(file_sink *sink,
                        const string& repopath,
                        const string& name,
                        const Metadata &metadata,
                        const bool& ignore_symlinks)
-    : cs_(cs), repopath_(repopath), name_(name), ignore_symlinks_(ignore_symlinks) {
-    tree_ = cs->open_tree(name, metadata, "");
+    : sink_(sink), repopath_(repopath), name_(name), ignore_symlinks_(ignore_symlinks) {
+    tree_ = sink->open_tree(name, metadata, "");
 }
 
 fs_indexer::~fs_indexer() {
@@ -29,7 +29,7 @@ fs_indexer::~fs_indexer() {
 void fs_indexer::read_file(const fs::path& path) {
     ifstream in(path.c_str(), ios::in);
     fs::path relpath = fs::relative(path, repopath_);
-    cs_->index_file(tree_, relpath.string(), StringPiece(static_cast<stringstream const&>(stringstream() << in.rdbuf()).str().c_str(), fs::file_size(path)));
+    sink_->index_file(tree_, relpath.string(), StringPiece(static_cast<stringstream const&>(stringstream() << in.rdbuf()).str().c_str(), fs::file_size(path)));
 }
 
 void fs_indexer::walk_contents_file(const fs::path& contents_file_path) {
@@ -46,7 +46,7 @@ void fs_indexer::walk_contents_file(const fs::path& contents_file_path) {
 }
 
 void fs_indexer::walk(const fs::path& path) {
-    static int recursion_depth = 0;
+    static thread_local int recursion_depth = 0;
     RecursionCounter guard(recursion_depth);
     if (recursion_depth > kMaxRecursion)
         return;
@@ -11,14 +11,14 @@
 #include <string>
 #include "src/proto/config.pb.h"
 
-class code_searcher;
+class file_sink;
 struct indexed_tree;
 namespace boost { namespace filesystem { class path; } }
 
 
 class fs_indexer {
 public:
-    fs_indexer(code_searcher *cs,
+    fs_indexer(file_sink *sink,
                const string& repopath,
                const string& name,
                const Metadata &metadata,
@@ -27,7 +27,7 @@ public:
     void walk(const boost::filesystem::path& path);
     void walk_contents_file(const boost::filesystem::path& contents_file_path);
 protected:
-    code_searcher *cs_;
+    file_sink *sink_;
     std::string repopath_;
     std::string name_;
     const indexed_tree *tree_;
@@ -15,12 +15,12 @@ using namespace std;
 DEFINE_string(order_root, "", "Walk top-level directories in this order.");
 DEFINE_bool(revparse, false, "Display parsed revisions, rather than as-provided");
 
-git_indexer::git_indexer(code_searcher *cs,
+git_indexer::git_indexer(file_sink *sink,
                          const string& repopath,
                          const string& name,
                          const Metadata &metadata,
                          bool walk_submodules)
-    : cs_(cs), repo_(0), repopath_(repopath), name_(name), metadata_(metadata)
+    : sink_(sink), repo_(0), repopath_(repopath), name_(name), metadata_(metadata)
     , walk_submodules_(walk_submodules) {
     int err;
     if ((err = git_libgit2_init()) < 0)
@@ -53,7 +53,7 @@ void git_indexer::walk(const string& ref) {
     string version = FLAGS_revparse ?
         strdup(git_oid_tostr(oidstr, sizeof(oidstr), git_commit_id(commit))) : ref;
 
-    idx_tree_ = cs_->open_tree(name_, metadata_, version);
+    idx_tree_ = sink_->open_tree(name_, metadata_, version);
     walk_tree("", FLAGS_order_root, tree);
 }
 
@@ -102,7 +102,7 @@ void git_indexer::walk_tree(const string& pfx,
         } else if (git_tree_entry_type(*it) == GIT_OBJ_BLOB) {
             if (is_object_from_repo) {
                 const char *data = static_cast<const char*>(git_blob_rawcontent(obj));
-                cs_->index_file(idx_tree_, submodule_prefix_ + path, StringPiece(data, git_blob_rawsize(obj)));
+                sink_->index_file(idx_tree_, submodule_prefix_ + path, StringPiece(data, git_blob_rawsize(obj)));
             } else {
                 fprintf(stderr, "Unable to convert git tree entry %s to object, skipping\n", oid);
                 continue;
@@ -121,7 +121,7 @@ void git_indexer::walk_tree(const string& pfx,
             string sub_repopath = repopath_ + "/" + path;
             Metadata meta;
 
-            git_indexer sub_indexer(cs_, sub_repopath, string(sub_name), meta, walk_submodules_);
+            git_indexer sub_indexer(sink_, sub_repopath, string(sub_name), meta, walk_submodules_);
             sub_indexer.submodule_prefix_ = submodule_prefix_ + path + "/";
 
             sub_indexer.walk(string(oid));
@@ -11,14 +11,14 @@
 #include <string>
 #include "src/proto/config.pb.h"
 
-class code_searcher;
+class file_sink;
 class git_repository;
 class git_tree;
 struct indexed_tree;
 
 class git_indexer {
 public:
-    git_indexer(code_searcher *cs,
+    git_indexer(file_sink *sink,
                 const std::string& repopath,
                 const std::string& name,
                 const Metadata &metadata,
@@ -30,7 +30,7 @@ protected:
                    const std::string& order,
                    git_tree *tree);
 
-    code_searcher *cs_;
+    file_sink *sink_;
     git_repository *repo_;
     const indexed_tree *idx_tree_;
     std::string repopath_;
@@ -0,0 +1,190 @@
+/********************************************************************
+ * livegrep -- index_pipeline.cc
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#include "src/index_pipeline.h"
+#include "src/lib/executor.h"
+
+#include <exception>
+
+// A tree opened, or a file read, by a source. A file is `ready' once
+// it has been prepared.
+struct index_pipeline::item {
+    std::unique_ptr<indexed_tree> tree;
+    code_searcher::prepared_file file;
+    bool ready;
+};
+
+class index_pipeline::source : public file_sink {
+public:
+    // Thrown to stop a reader whose pipeline is being torn down.
+    struct aborted { };
+
+    source(index_pipeline *pipeline, const reader &read)
+        : pipeline_(pipeline), read_(read), pending_(0),
+          started_(false), done_(false) { }
+
+    virtual const indexed_tree *open_tree(const string &name, const Metadata &meta,
+                                          const string& version) {
+        auto it = std::make_unique<item>();
+        it->tree = std::make_unique<indexed_tree>();
+        it->tree->name = name;
+        it->tree->metadata = meta;
+        it->tree->version = version;
+        it->ready = true;
+        const indexed_tree *tree = it->tree.get();
+        {
+            std::unique_lock<std::mutex> lock(pipeline_->mtx_);
+            items_.push_back(std::move(it));
+        }
+        pipeline_->notify();
+        return tree;
+    }
+
+    virtual void index_file(const indexed_tree *tree,
+                            const string& path,
+                            StringPiece contents) {
+        auto it = std::make_unique<item>();
+        it->file.tree = tree;
+        it->file.path = path;
+        it->file.data.assign(contents.data(), contents.size());
+        it->file.contents = it->file.data;
+        it->ready = false;
+        item *raw = it.get();
+        {
+            std::unique_lock<std::mutex> lock(pipeline_->mtx_);
+            // Always let one file through, however big.
+            while (!pipeline_->aborted_ &&
+                   pending_ && pending_ + contents.size() > kMaxPendingBytes)
+                pipeline_->cond_.wait(lock);
+            if (pipeline_->aborted_)
+                throw aborted();
+            pending_ += contents.size();
+            items_.push_back(std::move(it));
+        }
+
+        index_pipeline *pipeline = pipeline_;
+        pipeline_->workers_->submit([pipeline, raw] {
+                code_searcher::prepare_file(&raw->file);
+                {
+                    std::unique_lock<std::mutex> lock(pipeline->mtx_);
+                    raw->ready = true;
+                }
+                pipeline->notify();
+            });
+    }
+
+    void run() {
+        try {
+            read_(this);
+        } catch (aborted&) {
+        } catch (...) {
+            error_ = std::current_exception();
+        }
+        {
+            std::unique_lock<std::mutex> lock(pipeline_->mtx_);
+            done_ = true;
+        }
+        pipeline_->notify();
+    }
+
+    index_pipeline *pipeline_;
+    reader read_;
+    std::thread thread_;
+    std::exception_ptr error_;
+
+    // Protected by the pipeline's mtx_.
+    std::deque<std::unique_ptr<item>> items_;
+    // The bytes of the files in items_.
+    size_t pending_;
+    bool started_;
+    bool done_;
+};
+
+index_pipeline::index_pipeline(code_searcher *cs, int threads)
+    : cs_(cs), threads_(std::max(1, threads)),
+      workers_(new executor(threads_)), aborted_(false) {
+}
+
+// If finish() never ran, or threw, stop any readers still going, and
+// let the workers finish with the files they have before the files go
+// away.
+index_pipeline::~index_pipeline() {
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        aborted_ = true;
+    }
+    notify();
+    for (auto &src : sources_) {
+        if (src->thread_.joinable())
+            src->thread_.join();
+    }
+    workers_.reset();
+}
+
+void index_pipeline::add_source(const reader &read) {
+    sources_.emplace_back(new source(this, read));
+}
+
+void index_pipeline::notify() {
+    cond_.notify_all();
+}
+
+// Starts reading as many of the sources, in order, as there are
+// threads for. Called with mtx_ held.
+void index_pipeline::start_readers() {
+    int reading = 0;
+    for (auto &src : sources_) {
+        if (src->started_ && !src->done_)
+            reading++;
+    }
+    for (auto &src : sources_) {
+        if (reading >= threads_)
+            break;
+        if (!src->started_) {
+            src->started_ = true;
+            src->thread_ = std::thread(&source::run, src.get());
+            reading++;
+        }
+    }
+}
+
+void index_pipeline::finish() {
+    for (auto &ptr : sources_) {
+        source *src = ptr.get();
+        while (true) {
+            std::unique_ptr<item> it;
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                while (true) {
+                    start_readers();
+                    if (!src->items_.empty() ? src->items_.front()->ready : src->done_)
+                        break;
+                    cond_.wait(lock);
+                }
+                if (src->items_.empty())
+                    break;
+                it = std::move(src->items_.front());
+                src->items_.pop_front();
+            }
+
+            if (it->tree) {
+                cs_->trees_.push_back(std::move(it->tree));
+                continue;
+            }
+            cs_->commit_file(it->file);
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                src->pending_ -= it->file.contents.size();
+            }
+            notify();
+        }
+        src->thread_.join();
+        if (src->error_)
+            std::rethrow_exception(src->error_);
+    }
+    sources_.clear();
+}
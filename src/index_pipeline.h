@@ -0,0 +1,76 @@
+/********************************************************************
+ * livegrep -- index_pipeline.h
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#ifndef CODESEARCH_INDEX_PIPELINE_H
+#define CODESEARCH_INDEX_PIPELINE_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "src/codesearch.h"
+
+class executor;
+
+/*
+ * Builds a code_searcher's index from several sources at once.
+ *
+ * Each source -- a filesystem tree, or a git repository -- is read on
+ * a thread of its own. The files it reads are split into lines and
+ * hashed on a pool of workers, and then committed to the index on the
+ * thread that calls finish(). Sources are committed one after another,
+ * in the order they were added, and each one's trees and files in the
+ * order it read them, so the index comes out just as it would if every
+ * source were read on that one thread.
+ *
+ * Each source may read ahead of what has been committed by up to
+ * kMaxPendingBytes, and at most `threads' sources are read at once.
+ */
+class index_pipeline {
+public:
+    typedef std::function<void (file_sink *)> reader;
+
+    index_pipeline(code_searcher *cs, int threads);
+    ~index_pipeline();
+
+    // Adds a source, which `read' reads by feeding its trees and
+    // files to the file_sink it's passed.
+    void add_source(const reader &read);
+
+    // Reads and commits every source added.
+    void finish();
+
+private:
+    static const size_t kMaxPendingBytes = 64 << 20;
+
+    class source;
+    struct item;
+
+    void start_readers();
+    void notify();
+
+    code_searcher *cs_;
+    int threads_;
+    std::unique_ptr<executor> workers_;
+    std::vector<std::unique_ptr<source>> sources_;
+
+    // Guards every source's items and pending bytes, the state of
+    // every item, and aborted_.
+    std::mutex mtx_;
+    std::condition_variable cond_;
+    // Set once we're being destroyed, to stop the readers.
+    bool aborted_;
+
+    index_pipeline(const index_pipeline&);
+    void operator=(const index_pipeline&);
+};
+
+#endif /* CODESEARCH_INDEX_PIPELINE_H */
@@ -0,0 +1,101 @@
+/********************************************************************
+ * livegrep -- executor.cc
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#include "executor.h"
+
+namespace {
+    thread_local const executor *current_executor;
+    thread_local int current_index = -1;
+};
+
+executor::executor(int nthreads)
+    : next_(0), queued_(0), closed_(false) {
+    if (nthreads < 1)
+        nthreads = 1;
+    for (int i = 0; i < nthreads; ++i)
+        workers_.emplace_back(new worker);
+    for (int i = 0; i < nthreads; ++i)
+        workers_[i]->thread = std::thread(&executor::run, this, i);
+}
+
+executor::~executor() {
+    {
+        std::unique_lock<std::mutex> locked(idle_mtx_);
+        closed_ = true;
+        idle_cond_.notify_all();
+    }
+    for (auto it = workers_.begin(); it != workers_.end(); ++it)
+        (*it)->thread.join();
+}
+
+int executor::current_worker() const {
+    if (current_executor != this)
+        return -1;
+    return current_index;
+}
+
+void executor::submit(task fn) {
+    int self = current_worker();
+    if (self < 0)
+        self = next_++ % workers_.size();
+
+    {
+        std::unique_lock<std::mutex> locked(workers_[self]->mtx);
+        workers_[self]->tasks.push_back(std::move(fn));
+    }
+    {
+        std::unique_lock<std::mutex> locked(idle_mtx_);
+        ++queued_;
+    }
+    idle_cond_.notify_one();
+}
+
+bool executor::pop(int self, task *out) {
+    {
+        worker *w = workers_[self].get();
+        std::unique_lock<std::mutex> locked(w->mtx);
+        if (!w->tasks.empty()) {
+            *out = std::move(w->tasks.front());
+            w->tasks.pop_front();
+            --queued_;
+            return true;
+        }
+    }
+
+    int n = workers_.size();
+    for (int i = 1; i < n; ++i) {
+        worker *victim = workers_[(self + i) % n].get();
+        std::unique_lock<std::mutex> locked(victim->mtx);
+        if (!victim->tasks.empty()) {
+            *out = std::move(victim->tasks.back());
+            victim->tasks.pop_back();
+            --queued_;
+            return true;
+        }
+    }
+    return false;
+}
+
+void executor::run(int self) {
+    current_executor = this;
+    current_index = self;
+
+    task fn;
+    while (true) {
+        if (pop(self, &fn)) {
+            fn();
+            fn = nullptr;
+            continue;
+        }
+
+        std::unique_lock<std::mutex> locked(idle_mtx_);
+        while (queued_ == 0 && !closed_)
+            idle_cond_.wait(locked);
+        if (queued_ == 0 && closed_)
+            return;
+    }
+}
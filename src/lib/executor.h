@@ -0,0 +1,74 @@
+/********************************************************************
+ * livegrep -- executor.h
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#ifndef CODESEARCH_EXECUTOR_H
+#define CODESEARCH_EXECUTOR_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * A fixed pool of worker threads with one task deque per worker.
+ *
+ * Each worker runs tasks from the front of its own deque, and steals
+ * from the back of other workers' deques when its own is empty. A
+ * task submitted from a worker thread lands on the back of that
+ * worker's deque; tasks submitted from outside the pool are spread
+ * round-robin. Since each deque is consumed in FIFO order, callers
+ * that split their work into small tasks and re-submit as they go
+ * interleave fairly with everyone else using the pool.
+ */
+class executor {
+public:
+    typedef std::function<void ()> task;
+
+    explicit executor(int nthreads);
+    ~executor();
+
+    void submit(task fn);
+
+    int size() const {
+        return workers_.size();
+    }
+
+    // The index of the worker running the calling thread, or -1 if
+    // the caller is not one of this executor's workers.
+    int current_worker() const;
+
+protected:
+    struct worker {
+        std::mutex mtx;
+        std::deque<task> tasks;
+        std::thread thread;
+    };
+
+    bool pop(int self, task *out);
+    void run(int self);
+
+    std::vector<std::unique_ptr<worker>> workers_;
+    std::atomic<unsigned> next_;
+
+    // queued_ is only incremented with idle_mtx_ held, so a worker
+    // that checks it under the lock before sleeping cannot miss a
+    // wakeup.
+    std::mutex idle_mtx_;
+    std::condition_variable idle_cond_;
+    std::atomic<long> queued_;
+    bool closed_;
+
+private:
+    executor(const executor&);
+    void operator=(const executor&);
+};
+
+#endif /* CODESEARCH_EXECUTOR_H */
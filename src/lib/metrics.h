@@ -23,22 +23,13 @@ public:
 
     static void dump_all();
 
-#ifdef CODESEARCH_SLOWGTOD
-    class timer {
-    public:
-        timer(metric &m)  {}
-        void pause() {};
-        void start() {};
-    };
-#else
     class timer {
     public:
         timer(metric &m) : m_(&m) {}
 
         void pause() {
             tm_.pause();
-            timeval elapsed = tm_.elapsed();
-            m_->inc(elapsed.tv_sec * 1000000 + elapsed.tv_usec);
+            m_->inc(tm_.elapsed_ns() / 1000);
             tm_.reset();
         }
 
@@ -54,7 +45,6 @@ public:
         metric *m_;
         ::timer tm_;
     };
-#endif
 
 private:
     std::atomic_long val_;
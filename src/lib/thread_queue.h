@@ -40,6 +40,11 @@ public:
         return true;
     }
 
+    size_t size() {
+        std::unique_lock<std::mutex> locked(mutex_);
+        return queue_.size();
+    }
+
     bool try_pop(T *out) {
         std::unique_lock<std::mutex> locked(mutex_);
         if (queue_.empty())
@@ -8,16 +8,46 @@
 #ifndef CODESEARCH_TIMER_H
 #define CODESEARCH_TIMER_H
 #include <sys/time.h>
+#include <time.h>
+#include <stdint.h>
 #include <assert.h>
+#include <atomic>
 #include <mutex>
 
 static int timeval_subtract (struct timeval *result, struct timeval *x, struct timeval *y);
 static void timeval_add(struct timeval *res, const struct timeval *x, const struct timeval *y);
 
+/*
+ * Monotonic clocks, in nanoseconds. monotonic_ns() is precise enough
+ * to time individual RE2 calls; coarse_ns() only advances once per
+ * scheduler tick, but is cheaper still to read, and is plenty for
+ * checking deadlines measured in milliseconds.
+ */
+static inline int64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static inline int64_t coarse_ns() {
+#ifdef CLOCK_MONOTONIC_COARSE
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#else
+    return monotonic_ns();
+#endif
+}
+
+static inline struct timeval ns_to_timeval(int64_t ns) {
+    return (struct timeval){ time_t(ns / 1000000000),
+            suseconds_t((ns % 1000000000) / 1000) };
+}
+
 class timer {
 public:
     timer(bool startnow = true)
-        : running_(false), elapsed_({0,0}){
+        : running_(false), start_(0), elapsed_(0) {
         if (startnow)
             start();
     }
@@ -26,30 +56,30 @@ public:
         std::unique_lock<std::mutex> locked(lock_);
         assert(!running_);
         running_ = true;
-        gettimeofday(&start_, NULL);
+        start_ = monotonic_ns();
     }
 
     void pause() {
         std::unique_lock<std::mutex> locked(lock_);
-        struct timeval now, delta;
         assert(running_);
         running_ = false;
-        gettimeofday(&now, NULL);
-        timeval_subtract(&delta, &now, &start_);
-        timeval_add(&elapsed_, &delta, &elapsed_);
+        elapsed_ += monotonic_ns() - start_;
     }
 
     void reset() {
         std::unique_lock<std::mutex> locked(lock_);
         running_ = false;
-        elapsed_ = (struct timeval){0,0};
+        elapsed_ = 0;
     }
 
     void add(timer &other) {
-        std::unique_lock<std::mutex> locked(lock_);
-        assert(!running_);
-        struct timeval elapsed = other.elapsed();
-        timeval_add(&elapsed_, &elapsed_, &elapsed);
+        add_ns(other.elapsed_ns());
+    }
+
+    // Adds time measured elsewhere. Safe to call concurrently from any
+    // number of threads without taking the lock.
+    void add_ns(int64_t ns) {
+        elapsed_.fetch_add(ns, std::memory_order_relaxed);
     }
 
     bool running() {
@@ -57,22 +87,24 @@ public:
         return running_;
     }
 
-    struct timeval elapsed() {
+    int64_t elapsed_ns() {
         std::unique_lock<std::mutex> locked(lock_);
         if (running_) {
-            struct timeval now, delta;
-            gettimeofday(&now, NULL);
-            timeval_subtract(&delta, &now, &start_);
-            timeval_add(&elapsed_, &delta, &elapsed_);
+            int64_t now = monotonic_ns();
+            elapsed_ += now - start_;
             start_ = now;
         }
         return elapsed_;
     }
 
+    struct timeval elapsed() {
+        return ns_to_timeval(elapsed_ns());
+    }
+
 protected:
     bool running_;
-    struct timeval start_;
-    struct timeval elapsed_;
+    int64_t start_;
+    std::atomic<int64_t> elapsed_;
     std::mutex lock_;
 
     timer(const timer& rhs);
@@ -120,25 +152,22 @@ timeval_add(struct timeval *res, const struct timeval *x,
     }
 }
 
+/*
+ * Charges the lifetime of the run_timer to `timer'. This costs two
+ * clock reads and an atomic add, so it is cheap enough to wrap every
+ * individual RE2 call.
+ */
 class run_timer {
 public:
     run_timer(timer& timer)
-#ifndef CODESEARCH_SLOWGTOD
-        : timer_(timer), local_()
-#endif
-    {
+        : timer_(timer), start_(monotonic_ns()) {
     }
     ~run_timer() {
-#ifndef CODESEARCH_SLOWGTOD
-        local_.pause();
-        timer_.add(local_);
-#endif
+        timer_.add_ns(monotonic_ns() - start_);
     }
 protected:
-#ifndef CODESEARCH_SLOWGTOD
     timer &timer_;
-    timer local_;
-#endif
+    int64_t start_;
 };
 
 inline static long timeval_ms(struct timeval tv) {
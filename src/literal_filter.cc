@@ -0,0 +1,347 @@
+/********************************************************************
+ * livegrep -- literal_filter.cc
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#include "src/literal_filter.h"
+
+#include "re2/regexp.h"
+#include "re2/walker-inl.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+
+using namespace re2;
+using std::string;
+using std::vector;
+
+namespace {
+    // Most literals a filter will scan for at once.
+    const size_t kMaxLiterals = 8;
+    // Shortest literal worth scanning for.
+    const size_t kMinLiteral = 2;
+
+    /*
+     * What a subexpression tells us about the text it matches: if
+     * `exact', it matches exactly lits[0] (possibly the empty string);
+     * otherwise every match contains one of `lits', or nothing is
+     * known if `lits' is empty.
+     */
+    struct required {
+        bool exact;
+        vector<string> lits;
+
+        required() : exact(false) {}
+        explicit required(const string &lit) : exact(true), lits(1, lit) {}
+
+        // Every literal must be present for the filter to let any line
+        // through, so a set is only as good as its shortest literal.
+        size_t score() const {
+            if (lits.empty())
+                return 0;
+            size_t shortest = lits[0].size();
+            for (auto it = lits.begin(); it != lits.end(); ++it)
+                shortest = std::min(shortest, it->size());
+            return shortest;
+        }
+
+        bool better(const required &rhs) const {
+            if (score() != rhs.score())
+                return score() > rhs.score();
+            return lits.size() < rhs.lits.size();
+        }
+    };
+
+    void append_rune(string *out, Rune r, bool latin1) {
+        if (latin1 || r < 0x80) {
+            out->push_back(char(r));
+        } else if (r < 0x800) {
+            out->push_back(char(0xc0 | (r >> 6)));
+            out->push_back(char(0x80 | (r & 0x3f)));
+        } else if (r < 0x10000) {
+            out->push_back(char(0xe0 | (r >> 12)));
+            out->push_back(char(0x80 | ((r >> 6) & 0x3f)));
+            out->push_back(char(0x80 | (r & 0x3f)));
+        } else {
+            out->push_back(char(0xf0 | (r >> 18)));
+            out->push_back(char(0x80 | ((r >> 12) & 0x3f)));
+            out->push_back(char(0x80 | ((r >> 6) & 0x3f)));
+            out->push_back(char(0x80 | (r & 0x3f)));
+        }
+    }
+
+    unsigned char fold_byte(unsigned char c) {
+        return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+    }
+
+    bool is_letter(unsigned char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+    }
+};
+
+class RequiredWalker : public Regexp::Walker<required> {
+public:
+    RequiredWalker() : fold_(false) {}
+
+    virtual required PostVisit(Regexp* re, required parent_arg,
+                               required pre_arg,
+                               required *child_args, int nchild_args);
+
+    virtual required ShortVisit(Regexp* re, required parent_arg) {
+        return required();
+    }
+
+    // Whether any case-folded literal was seen.
+    bool fold_;
+
+protected:
+    required literal(Regexp *re, Rune *runes, int nrunes);
+};
+
+/*
+ * RE2 only leaves a literal case-folded when its other case is a
+ * single ASCII letter; anything else becomes a character class. Should
+ * a folded rune outside ASCII turn up anyway, split the literal there.
+ */
+required RequiredWalker::literal(Regexp *re, Rune *runes, int nrunes) {
+    bool fold = re->parse_flags() & Regexp::FoldCase;
+    bool latin1 = re->parse_flags() & Regexp::Latin1;
+    required out;
+    string piece;
+    bool split = false;
+    for (int i = 0; i <= nrunes; i++) {
+        if (i < nrunes && !(fold && runes[i] >= 0x80)) {
+            if (fold) {
+                piece.push_back(fold_byte(runes[i]));
+                fold_ = true;
+            } else {
+                append_rune(&piece, runes[i], latin1);
+            }
+            continue;
+        }
+        required cand(piece);
+        cand.exact = false;
+        if (cand.better(out))
+            out = cand;
+        piece.clear();
+        if (i < nrunes)
+            split = true;
+    }
+    out.exact = !split;
+    return out;
+}
+
+required RequiredWalker::PostVisit(Regexp* re, required parent_arg,
+                                   required pre_arg,
+                                   required *child_args, int nchild_args) {
+    switch (re->op()) {
+    // These ops match the empty string:
+    case kRegexpEmptyMatch:
+    case kRegexpBeginLine:
+    case kRegexpEndLine:
+    case kRegexpBeginText:
+    case kRegexpEndText:
+    case kRegexpWordBoundary:
+    case kRegexpNoWordBoundary:
+        return required(string());
+
+    case kRegexpLiteral: {
+        Rune r = re->rune();
+        return literal(re, &r, 1);
+    }
+
+    case kRegexpLiteralString:
+        return literal(re, re->runes(), re->nrunes());
+
+    case kRegexpConcat: {
+        // Runs of exact children concatenate into a single literal.
+        required best;
+        string run;
+        bool exact = true;
+        for (int i = 0; i <= nchild_args; i++) {
+            if (i < nchild_args && child_args[i].exact) {
+                run += child_args[i].lits[0];
+                continue;
+            }
+            if (i == nchild_args && exact)
+                break;
+            required cand(run);
+            cand.exact = false;
+            if (cand.better(best))
+                best = cand;
+            run.clear();
+            if (i < nchild_args) {
+                exact = false;
+                if (child_args[i].better(best))
+                    best = child_args[i];
+            }
+        }
+        if (exact)
+            return required(run);
+        return best;
+    }
+
+    case kRegexpAlternate: {
+        required out;
+        for (int i = 0; i < nchild_args; i++) {
+            if (child_args[i].score() == 0)
+                return required();
+            for (auto it = child_args[i].lits.begin();
+                 it != child_args[i].lits.end(); ++it) {
+                if (std::find(out.lits.begin(), out.lits.end(), *it) == out.lits.end())
+                    out.lits.push_back(*it);
+            }
+        }
+        if (out.lits.size() > kMaxLiterals)
+            return required();
+        return out;
+    }
+
+    case kRegexpCapture:
+        return child_args[0];
+
+    case kRegexpPlus: {
+        required out = child_args[0];
+        out.exact = false;
+        return out;
+    }
+
+    case kRegexpRepeat: {
+        if (re->min() == 0)
+            return required();
+        required out = child_args[0];
+        out.exact = out.exact && re->max() == 1;
+        return out;
+    }
+
+    default:
+        // Star, Quest, and any single character that isn't a literal.
+        return required();
+    }
+}
+
+std::unique_ptr<literal_filter> literal_filter::for_regex(const RE2 &re) {
+    RequiredWalker walker;
+    required req = walker.Walk(re.Regexp(), required());
+    if (req.score() < kMinLiteral)
+        return nullptr;
+    if (walker.fold_) {
+        for (auto it = req.lits.begin(); it != req.lits.end(); ++it)
+            std::transform(it->begin(), it->end(), it->begin(), fold_byte);
+    }
+    return std::unique_ptr<literal_filter>(new literal_filter(req.lits, walker.fold_));
+}
+
+literal_filter::literal_filter(const vector<string> &literals, bool fold)
+    : literals_(literals), fold_(fold), max_last_(0), scan_(scan_scalar) {
+    for (auto it = literals_.begin(); it != literals_.end(); ++it) {
+        needle n;
+        n.lit = *it;
+        n.first = n.lit.front();
+        n.last = n.lit.back();
+        n.first_fold = (fold_ && is_letter(n.first)) ? 0x20 : 0;
+        n.last_fold = (fold_ && is_letter(n.last)) ? 0x20 : 0;
+        needles_.push_back(n);
+        max_last_ = std::max(max_last_, n.lit.size() - 1);
+    }
+
+#if defined(__x86_64__) && defined(__GNUC__)
+    scan_ = __builtin_cpu_supports("avx2") ? scan_avx2 : scan_sse2;
+#endif
+}
+
+bool literal_filter::matches(const needle &n, const char *p, const char *end) const {
+    if (size_t(end - p) < n.lit.size())
+        return false;
+    if (!fold_)
+        return memcmp(p, n.lit.data(), n.lit.size()) == 0;
+    for (size_t i = 0; i < n.lit.size(); i++) {
+        if (fold_byte(p[i]) != (unsigned char)n.lit[i])
+            return false;
+    }
+    return true;
+}
+
+const char *literal_filter::find(const char *p, const char *end) const {
+    return scan_(*this, p, end);
+}
+
+const char *literal_filter::scan_scalar(const literal_filter &f,
+                                        const char *p, const char *end) {
+    for (; p < end; p++) {
+        unsigned char c = *p;
+        for (auto n = f.needles_.begin(); n != f.needles_.end(); ++n) {
+            if ((c | n->first_fold) == n->first && f.matches(*n, p, end))
+                return p;
+        }
+    }
+    return end;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+/*
+ * Each block yields a bitmask of the positions whose first and last
+ * bytes agree with some literal; only those are compared in full.
+ * Blocks stop while every literal's last byte can still be loaded, and
+ * the scalar scan finishes the tail.
+ */
+const char *literal_filter::scan_sse2(const literal_filter &f,
+                                      const char *p, const char *end) {
+    while (end - p >= ptrdiff_t(f.max_last_ + 16)) {
+        unsigned mask = 0;
+        for (auto n = f.needles_.begin(); n != f.needles_.end(); ++n) {
+            __m128i a = _mm_loadu_si128((const __m128i*)p);
+            __m128i b = _mm_loadu_si128((const __m128i*)(p + n->lit.size() - 1));
+            a = _mm_or_si128(a, _mm_set1_epi8(n->first_fold));
+            b = _mm_or_si128(b, _mm_set1_epi8(n->last_fold));
+            __m128i eq = _mm_and_si128(_mm_cmpeq_epi8(a, _mm_set1_epi8(n->first)),
+                                       _mm_cmpeq_epi8(b, _mm_set1_epi8(n->last)));
+            mask |= _mm_movemask_epi8(eq);
+        }
+        while (mask) {
+            int i = __builtin_ctz(mask);
+            mask &= mask - 1;
+            for (auto n = f.needles_.begin(); n != f.needles_.end(); ++n) {
+                if (f.matches(*n, p + i, end))
+                    return p + i;
+            }
+        }
+        p += 16;
+    }
+    return scan_scalar(f, p, end);
+}
+
+__attribute__((target("avx2")))
+const char *literal_filter::scan_avx2(const literal_filter &f,
+                                      const char *p, const char *end) {
+    while (end - p >= ptrdiff_t(f.max_last_ + 32)) {
+        unsigned mask = 0;
+        for (auto n = f.needles_.begin(); n != f.needles_.end(); ++n) {
+            __m256i a = _mm256_loadu_si256((const __m256i*)p);
+            __m256i b = _mm256_loadu_si256((const __m256i*)(p + n->lit.size() - 1));
+            a = _mm256_or_si256(a, _mm256_set1_epi8(n->first_fold));
+            b = _mm256_or_si256(b, _mm256_set1_epi8(n->last_fold));
+            __m256i eq = _mm256_and_si256(_mm256_cmpeq_epi8(a, _mm256_set1_epi8(n->first)),
+                                          _mm256_cmpeq_epi8(b, _mm256_set1_epi8(n->last)));
+            mask |= _mm256_movemask_epi8(eq);
+        }
+        while (mask) {
+            int i = __builtin_ctz(mask);
+            mask &= mask - 1;
+            for (auto n = f.needles_.begin(); n != f.needles_.end(); ++n) {
+                if (f.matches(*n, p + i, end))
+                    return p + i;
+            }
+        }
+        p += 32;
+    }
+    return scan_scalar(f, p, end);
+}
+#endif
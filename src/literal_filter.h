@@ -0,0 +1,76 @@
+/********************************************************************
+ * livegrep -- literal_filter.h
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#ifndef CODESEARCH_LITERAL_FILTER_H
+#define CODESEARCH_LITERAL_FILTER_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "re2/re2.h"
+
+/*
+ * A handful of byte strings, at least one of which occurs in anything
+ * a regex can match, together with a vectorized scanner that finds
+ * them. Running the scanner ahead of RE2 lets a search skip straight
+ * past text that cannot match.
+ *
+ * If fold_case() is set, the literals are lowercase and match text
+ * ignoring ASCII case.
+ */
+class literal_filter {
+public:
+    // Returns nullptr if `re' has no required literals worth scanning
+    // for.
+    static std::unique_ptr<literal_filter> for_regex(const RE2 &re);
+
+    // Returns the start of the first occurrence of any of the literals
+    // in [p, end), or `end' if there is none.
+    const char *find(const char *p, const char *end) const;
+
+    const std::vector<std::string> &literals() const { return literals_; }
+    bool fold_case() const { return fold_; }
+
+protected:
+    // Each literal is scanned for by its first and last bytes, 16 or
+    // 32 positions at a time, and candidates are then compared in
+    // full.
+    struct needle {
+        std::string lit;
+        unsigned char first, last;
+        // 0x20 where fold_ is set and the byte is a letter, so that
+        // or-ing it into the text folds the text's case.
+        unsigned char first_fold, last_fold;
+    };
+
+    typedef const char *(*scan_func)(const literal_filter &,
+                                     const char *, const char *);
+
+    literal_filter(const std::vector<std::string> &literals, bool fold);
+
+    bool matches(const needle &n, const char *p, const char *end) const;
+
+    std::vector<std::string> literals_;
+    bool fold_;
+    std::vector<needle> needles_;
+    size_t max_last_;
+    scan_func scan_;
+
+    // The scanners; the constructor picks the widest one the CPU
+    // supports.
+    static const char *scan_scalar(const literal_filter &f,
+                                   const char *p, const char *end);
+#if defined(__x86_64__) && defined(__GNUC__)
+    static const char *scan_sse2(const literal_filter &f,
+                                 const char *p, const char *end);
+    static const char *scan_avx2(const literal_filter &f,
+                                 const char *p, const char *end);
+#endif
+};
+
+#endif /* CODESEARCH_LITERAL_FILTER_H */
@@ -0,0 +1,169 @@
+/********************************************************************
+ * livegrep -- query_cache.cc
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#include "src/query_cache.h"
+#include "src/query_planner.h"
+#include "src/re_width.h"
+
+#include "src/lib/metrics.h"
+
+#include "gflags/gflags.h"
+
+#include <algorithm>
+
+DEFINE_int32(query_cache_size, 4096, "Number of compiled regexes to keep around between queries. 0 disables the cache.");
+
+namespace {
+    // Each kind of lookup has its own counters, since a pattern's
+    // plan can miss where its compiled regex hits.
+    metric compile_hits("query_cache.compile.hits");
+    metric compile_misses("query_cache.compile.misses");
+    metric plan_hits("query_cache.plan.hits");
+    metric plan_misses("query_cache.plan.misses");
+    metric width_hits("query_cache.width.hits");
+    metric width_misses("query_cache.width.misses");
+    metric query_cache_evictions("query_cache.evictions");
+};
+
+query_cache::query_cache(size_t capacity) : capacity_(capacity) {
+}
+
+query_cache *query_cache::shared() {
+    static query_cache *cache = new query_cache(std::max(FLAGS_query_cache_size, 0));
+    return cache;
+}
+
+std::string query_cache::key(const std::string &pattern, const RE2::Options &opts) {
+    std::string out;
+    out += char('0' + opts.encoding());
+    out += opts.posix_syntax()   ? 'p' : '-';
+    out += opts.longest_match()  ? 'l' : '-';
+    out += opts.literal()        ? 'L' : '-';
+    out += opts.never_nl()       ? 'n' : '-';
+    out += opts.dot_nl()         ? 'd' : '-';
+    out += opts.never_capture()  ? 'c' : '-';
+    out += opts.case_sensitive() ? 's' : '-';
+    out += opts.perl_classes()   ? 'P' : '-';
+    out += opts.word_boundary()  ? 'w' : '-';
+    out += opts.one_line()       ? 'o' : '-';
+    out += std::to_string(opts.max_mem());
+    out += ':';
+    out += pattern;
+    return out;
+}
+
+query_cache::entry *query_cache::lookup(const std::string &key) {
+    auto it = index_.find(key);
+    if (it == index_.end())
+        return nullptr;
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return &it->second->second;
+}
+
+query_cache::entry *query_cache::insert(const std::string &key,
+                                        const std::shared_ptr<RE2> &re) {
+    if (capacity_ == 0)
+        return nullptr;
+    entry *e = lookup(key);
+    if (e)
+        return e;
+    if (lru_.size() >= capacity_) {
+        index_.erase(lru_.back().first);
+        lru_.pop_back();
+        query_cache_evictions.inc();
+    }
+    lru_.push_front(std::make_pair(key, (entry){re, {}, -1}));
+    index_[key] = lru_.begin();
+    return &lru_.front().second;
+}
+
+std::shared_ptr<RE2> query_cache::compile(const std::string &pattern,
+                                          const RE2::Options &opts) {
+    std::string k = key(pattern, opts);
+    {
+        std::unique_lock<std::mutex> locked(mtx_);
+        entry *e = lookup(k);
+        if (e) {
+            compile_hits.inc();
+            return e->re;
+        }
+    }
+    compile_misses.inc();
+
+    // Compile without the lock held; if another thread beat us to it,
+    // the first one in wins.
+    std::shared_ptr<RE2> re(new RE2(pattern, opts));
+    if (!re->ok())
+        return re;
+
+    std::unique_lock<std::mutex> locked(mtx_);
+    entry *e = insert(k, re);
+    return e ? e->re : re;
+}
+
+const boost::intrusive_ptr<QueryPlan> *query_cache::find_plan(const entry *e,
+                                                              uint64_t generation) {
+    for (auto &p : e->plans) {
+        if (p.first == generation)
+            return &p.second;
+    }
+    return nullptr;
+}
+
+boost::intrusive_ptr<QueryPlan> query_cache::plan(const std::shared_ptr<RE2> &re,
+                                                  const corpus_stats *corpus,
+                                                  uint64_t generation) {
+    std::string k = key(re->pattern(), re->options());
+    {
+        std::unique_lock<std::mutex> locked(mtx_);
+        entry *e = lookup(k);
+        const boost::intrusive_ptr<QueryPlan> *cached = e ? find_plan(e, generation) : nullptr;
+        if (cached) {
+            plan_hits.inc();
+            return *cached;
+        }
+    }
+    plan_misses.inc();
+
+    boost::intrusive_ptr<QueryPlan> plan = constructQueryPlan(*re, corpus);
+
+    std::unique_lock<std::mutex> locked(mtx_);
+    entry *e = insert(k, re);
+    if (e && !find_plan(e, generation)) {
+        if (e->plans.size() >= kMaxPlans)
+            e->plans.erase(e->plans.begin());
+        e->plans.push_back(std::make_pair(generation, plan));
+    }
+    return plan;
+}
+
+int query_cache::width(const std::shared_ptr<RE2> &re) {
+    std::string k = key(re->pattern(), re->options());
+    {
+        std::unique_lock<std::mutex> locked(mtx_);
+        entry *e = lookup(k);
+        if (e && e->width >= 0) {
+            width_hits.inc();
+            return e->width;
+        }
+    }
+    width_misses.inc();
+
+    WidthWalker walker;
+    int width = walker.Walk(re->Regexp(), 0);
+
+    std::unique_lock<std::mutex> locked(mtx_);
+    entry *e = insert(k, re);
+    if (e)
+        e->width = width;
+    return width;
+}
+
+size_t query_cache::size() {
+    std::unique_lock<std::mutex> locked(mtx_);
+    return lru_.size();
+}
@@ -0,0 +1,98 @@
+/********************************************************************
+ * livegrep -- query_cache.h
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#ifndef CODESEARCH_QUERY_CACHE_H
+#define CODESEARCH_QUERY_CACHE_H
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/intrusive_ptr.hpp>
+
+#include "re2/re2.h"
+
+class QueryPlan;
+class corpus_stats;
+
+/*
+ * A bounded LRU of compiled regexes, keyed by pattern and RE2
+ * options. Along with each RE2 it keeps the derived data a search
+ * needs -- its QueryPlan and its program width -- so that a repeated
+ * query skips compilation and analysis entirely.
+ *
+ * Cached RE2s and QueryPlans are shared between concurrent searches,
+ * and must not be modified.
+ */
+class query_cache {
+public:
+    explicit query_cache(size_t capacity);
+
+    // Returns the compiled form of `pattern', compiling it on a
+    // miss. Patterns that fail to compile are returned but not
+    // cached.
+    std::shared_ptr<RE2> compile(const std::string &pattern,
+                                 const RE2::Options &opts);
+
+    // Returns constructQueryPlan(*re, corpus), computing it on a miss.
+    // `generation' identifies `corpus' -- see code_searcher::generation()
+    // -- and must be 0 without one. Each entry keeps plans for the last
+    // kMaxPlans corpora it was planned against.
+    boost::intrusive_ptr<QueryPlan> plan(const std::shared_ptr<RE2> &re,
+                                         const corpus_stats *corpus = nullptr,
+                                         uint64_t generation = 0);
+
+    // Returns the WidthWalker width of `re', computing it on a miss.
+    int width(const std::shared_ptr<RE2> &re);
+
+    size_t size();
+
+    // The process-wide cache, sized by --query_cache_size.
+    static query_cache *shared();
+
+protected:
+    // Enough for the main and tags corpora, and no corpus at all.
+    static const size_t kMaxPlans = 4;
+
+    struct entry {
+        std::shared_ptr<RE2> re;
+        // Plans by corpus generation, oldest first.
+        std::vector<std::pair<uint64_t, boost::intrusive_ptr<QueryPlan>>> plans;
+        int width;
+    };
+    typedef std::list<std::pair<std::string, entry>> lru_list;
+
+    static std::string key(const std::string &pattern, const RE2::Options &opts);
+
+    // The plan `e' holds for `generation', if any. (A plan may itself
+    // be null.) Must be called with mtx_ held.
+    static const boost::intrusive_ptr<QueryPlan> *find_plan(const entry *e,
+                                                            uint64_t generation);
+
+    // Finds `key', marking it most recently used. Must be called with
+    // mtx_ held.
+    entry *lookup(const std::string &key);
+    // Adds `re' under `key' if it is not there yet, evicting the least
+    // recently used entry if the cache is full. Must be called with
+    // mtx_ held.
+    entry *insert(const std::string &key, const std::shared_ptr<RE2> &re);
+
+    size_t capacity_;
+    std::mutex mtx_;
+    lru_list lru_;
+    std::unordered_map<std::string, lru_list::iterator> index_;
+
+private:
+    query_cache(const query_cache&);
+    void operator=(const query_cache&);
+};
+
+#endif /* CODESEARCH_QUERY_CACHE_H */
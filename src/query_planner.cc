@@ -9,6 +9,7 @@
 #include "src/lib/debug.h"
 
 #include "src/query_planner.h"
+#include "src/corpus_stats.h"
 
 #include <gflags/gflags.h>
 
@@ -24,34 +25,92 @@ const unsigned kMinWeight = 16;
 const int kMaxWidth       = 32;
 const int kMaxRecursion   = 10;
 const int kMaxNodes       = (1 << 24);
+const int kMaxBranches    = 64;
+const int kMaxConjuncts   = 4;
+// What walking one plan node costs, relative to verifying one byte.
+const double kNodeCost    = 2048;
 
 namespace {
     static QueryPlan::Stats null_stats;
+
+    // The corpus the plan under construction is for, if any. Set by
+    // constructQueryPlan for the duration of a walk.
+    thread_local const corpus_stats *plan_corpus;
+
+    struct corpus_scope {
+        const corpus_stats *saved;
+        explicit corpus_scope(const corpus_stats *corpus) : saved(plan_corpus) {
+            plan_corpus = corpus;
+        }
+        ~corpus_scope() {
+            plan_corpus = saved;
+        }
+    };
+
+    /*
+     * The chance that a position starts with a byte in `range' and then
+     * matches `next'. Where the bytes that follow are known, we bound
+     * it by the frequency of the trigram they start: a string occurs no
+     * more often than its rarest trigram, and in source code that bound
+     * is much closer to the truth than chaining conditional
+     * probabilities, which underestimates common identifiers by orders
+     * of magnitude.
+     */
+    double edge_selectivity(const corpus_stats *corpus,
+                            pair<uchar, uchar> range,
+                            const QueryPlan::Stats& next) {
+        double sel = 0;
+        for (int c = range.first; c <= range.second; c++) {
+            double p = corpus->unigram(c);
+            if (next.lead_ < 0) {
+                sel += p * next.selectivity_;
+                continue;
+            }
+            p *= corpus->bigram(c, next.lead_);
+            if (next.lead2_ >= 0)
+                p *= corpus->trigram(c, next.lead_, next.lead2_);
+            sel += min(p, next.selectivity_);
+        }
+        return sel;
+    }
 };
 
 QueryPlan::Stats::Stats ()
-    : selectivity_(1.0), depth_(0), nodes_(1), tail_paths_(1) {
+    : selectivity_(1.0), depth_(0), nodes_(1), tail_paths_(1),
+      lead_(-1), lead2_(-1) {
 }
 
 QueryPlan::Stats QueryPlan::Stats::insert(const value_type& val) const {
     Stats out(*this);
-    if (out.selectivity_ == 1.0) {
+    bool first = (out.selectivity_ == 1.0);
+    if (first) {
         out.selectivity_ = 0.0;
         out.tail_paths_  = 0;
     }
 
     const Stats& rstats = val.second ? val.second->stats() : null_stats;
 
-    // There are 100 printable ASCII characters. As a zeroth-order
-    // approximation, assume our corpus is random strings of printable
-    // ASCII characters.  The exact computation of selectivity turn
-    // out not to matter all that much in most cases.
-    out.selectivity_ += (val.first.second - val.first.first + 1)/100. * rstats.selectivity_;
+    if (plan_corpus) {
+        out.selectivity_ += edge_selectivity(plan_corpus, val.first, rstats);
+    } else {
+        // There are 100 printable ASCII characters. As a zeroth-order
+        // approximation, assume our corpus is random strings of printable
+        // ASCII characters.  The exact computation of selectivity turn
+        // out not to matter all that much in most cases.
+        out.selectivity_ += (val.first.second - val.first.first + 1)/100. * rstats.selectivity_;
+    }
     out.depth_ = max(depth_, rstats.depth_ + 1);
     out.nodes_ += (val.first.second - val.first.first + 1) * rstats.nodes_;
     if (!val.second)
         out.tail_paths_ += (val.first.second - val.first.first + 1);
 
+    if (first && val.first.first == val.first.second) {
+        out.lead_  = val.first.first;
+        out.lead2_ = rstats.lead_;
+    } else {
+        out.lead_ = out.lead2_ = -1;
+    }
+
     return out;
 }
 
@@ -65,6 +124,27 @@ QueryPlan::Stats QueryPlan::Stats::concat(const QueryPlan::Stats& rhs) const {
     return out;
 }
 
+QueryPlan::Stats QueryPlan::Stats::disjoin(const QueryPlan::Stats& rhs) const {
+    Stats out(*this);
+    out.lead_ = out.lead2_ = -1;
+    out.selectivity_ = min(1.0, selectivity_ + rhs.selectivity_);
+    out.depth_ = max(depth_, rhs.depth_);
+    out.nodes_ += rhs.nodes_;
+    out.tail_paths_ += rhs.tail_paths_;
+
+    return out;
+}
+
+QueryPlan::Stats QueryPlan::Stats::conjoin(const QueryPlan::Stats& rhs) const {
+    Stats out(*this);
+    out.lead_ = out.lead2_ = -1;
+    out.selectivity_ *= rhs.selectivity_;
+    out.depth_ = max(depth_, rhs.depth_);
+    out.nodes_ += rhs.nodes_;
+
+    return out;
+}
+
 void QueryPlan::insert(const value_type& val) {
     stats_ = stats_.insert(val);
 
@@ -74,6 +154,28 @@ void QueryPlan::insert(const value_type& val) {
     }
 }
 
+void QueryPlan::add_branch(intrusive_ptr<QueryPlan> branch) {
+    assert(edges_.empty());
+    assert(branch && !branch->empty());
+    if (branches_.empty())
+        stats_ = branch->stats();
+    else
+        stats_ = stats_.disjoin(branch->stats());
+    branches_.push_back(branch);
+    anchor = kAnchorNone;
+}
+
+void QueryPlan::add_conjunct(intrusive_ptr<QueryPlan> conjunct) {
+    assert(edges_.empty() && branches_.empty());
+    assert(conjunct && !conjunct->empty());
+    if (conjuncts_.empty())
+        stats_ = conjunct->stats();
+    else
+        stats_ = stats_.conjoin(conjunct->stats());
+    conjuncts_.push_back(conjunct);
+    anchor = kAnchorNone;
+}
+
 double QueryPlan::selectivity() {
     if (empty())
         assert(stats_.selectivity_ == 1.0);
@@ -152,6 +254,20 @@ static string ToString(QueryPlan *k, int indent = 0) {
     string out;
     if (k == 0)
         return strprintf("%*.s[null]\n", indent, "");
+    if (!k->branches().empty()) {
+        for (auto it = k->branches().begin(); it != k->branches().end(); ++it) {
+            out += strprintf("%*.s[or] -> \n", indent, "");
+            out += ToString(it->get(), indent + 1);
+        }
+        return out;
+    }
+    if (!k->conjuncts().empty()) {
+        for (auto it = k->conjuncts().begin(); it != k->conjuncts().end(); ++it) {
+            out += strprintf("%*.s[and] -> \n", indent, "");
+            out += ToString(it->get(), indent + 1);
+        }
+        return out;
+    }
     if (k->empty())
         return strprintf("%*.s[]\n", indent, "");
 
@@ -169,6 +285,8 @@ string QueryPlan::ToString() {
     string out = ::ToString(this, 0);
 
     out += "|";
+    if (anchor & kAnchorLineStart)
+        out += "^";
     if (anchor & kAnchorLeft)
         out += "<";
     if (anchor & kAnchorRepeat)
@@ -255,6 +373,8 @@ namespace {
     }
 
     intrusive_ptr<QueryPlan> Concat(intrusive_ptr<QueryPlan> *children, int nchildren);
+    intrusive_ptr<QueryPlan> Conjunction(intrusive_ptr<QueryPlan> primary,
+                                         const vector<intrusive_ptr<QueryPlan> >& others);
     intrusive_ptr<QueryPlan> CaseFoldLiteral(Rune *runes, int nrunes) {
         if (nrunes == 0)
             return Empty();
@@ -316,16 +436,30 @@ namespace {
         return true;
     }
 
+    /*
+     * The expected work of searching with a plan, in bytes of text run
+     * through RE2: each candidate line has to be verified, and each
+     * node of the plan costs a binary search of the suffix array.
+     */
+    double Cost(const QueryPlan::Stats& st) {
+        double candidates = min(st.selectivity_ * plan_corpus->bytes(),
+                                double(plan_corpus->lines()));
+        return candidates * plan_corpus->line_length() + kNodeCost * st.nodes_;
+    }
+
     bool Prefer(const QueryPlan::Stats& lhs,
                 const QueryPlan::Stats& rhs) {
+        if (plan_corpus)
+            return Cost(lhs) < Cost(rhs);
         return (lhs.selectivity_ < rhs.selectivity_);
-        /*
-        return (kRECost * lhs.selectivity_ + kNodeCost * lhs.nodes_ <
-                kRECost * rhs.selectivity_ + kNodeCost * rhs.nodes_);
-        */
     }
 
-    intrusive_ptr<QueryPlan> Concat(intrusive_ptr<QueryPlan> lhs, intrusive_ptr<QueryPlan> rhs) {
+    /*
+     * Join `rhs' onto the end of `lhs' if we can; otherwise keep the
+     * more selective of the two, and add the other to `dropped'.
+     */
+    intrusive_ptr<QueryPlan> Concat(intrusive_ptr<QueryPlan> lhs, intrusive_ptr<QueryPlan> rhs,
+                                    vector<intrusive_ptr<QueryPlan> > *dropped) {
         assert(lhs);
         intrusive_ptr<QueryPlan> out = lhs;
 
@@ -340,9 +474,11 @@ namespace {
             out->concat(rhs);
         } else if(Prefer(lhs->stats(), rhs->stats()))  {
             out->anchor &= ~kAnchorRight;
+            dropped->push_back(rhs);
         } else {
             out = rhs;
             out->anchor &= ~kAnchorLeft;
+            dropped->push_back(lhs);
         }
 
         debug(kDebugIndexAll, "[%s]", out->ToString().c_str());
@@ -398,12 +534,59 @@ namespace {
             return Any();
         }
 
+        vector<intrusive_ptr<QueryPlan> > dropped;
         intrusive_ptr<QueryPlan> out = *best_start;
         for (ptr = best_start + 1; ptr != end; ptr++) {
-            out = Concat(out, *ptr);
+            out = Concat(out, *ptr, &dropped);
         }
-        if (best_start != children)
+        // If what we kept still starts right after a ^, so do all its
+        // matches.
+        if (out == *best_start && (out->anchor & kAnchorLeft) &&
+            best_start != children && *(best_start - 1) &&
+            (*(best_start - 1))->empty() &&
+            ((*(best_start - 1))->anchor & kAnchorLineStart))
+            out->anchor |= kAnchorLineStart;
+        if (best_start != children) {
             out->anchor &= ~kAnchorLeft;
+            dropped.push_back(Concat(children, best_start - children));
+        }
+        return Conjunction(out, dropped);
+    }
+
+    /*
+     * Pieces of a concatenation that Concat couldn't join to `primary'
+     * still have to match on the same line, so those that are selective
+     * enough to be worth a walk of the suffix array become conjuncts.
+     */
+    intrusive_ptr<QueryPlan> Conjunction(intrusive_ptr<QueryPlan> primary,
+                                         const vector<intrusive_ptr<QueryPlan> >& others) {
+        vector<intrusive_ptr<QueryPlan> > parts;
+        auto add = [&parts](intrusive_ptr<QueryPlan> p) {
+            if (!p || p->empty() || p->weight() < kMinWeight)
+                return;
+            if (p->conjuncts().empty())
+                parts.push_back(p);
+            else
+                parts.insert(parts.end(), p->conjuncts().begin(), p->conjuncts().end());
+        };
+        add(primary);
+        if (parts.empty())
+            return primary;
+        for (auto it = others.begin(); it != others.end(); ++it)
+            add(*it);
+        if (parts.size() == 1)
+            return primary;
+
+        std::stable_sort(parts.begin(), parts.end(),
+                         [](intrusive_ptr<QueryPlan> a, intrusive_ptr<QueryPlan> b) {
+                             return Prefer(a->stats(), b->stats());
+                         });
+        if (parts.size() > kMaxConjuncts)
+            parts.resize(kMaxConjuncts);
+
+        intrusive_ptr<QueryPlan> out(new QueryPlan());
+        for (auto it = parts.begin(); it != parts.end(); ++it)
+            out->add_conjunct(*it);
         return out;
     }
 
@@ -477,6 +660,8 @@ namespace {
             return lhs;
         if (!lhs || !rhs ||
             lhs->empty() || rhs->empty() ||
+            !lhs->branches().empty() || !rhs->branches().empty() ||
+            !lhs->conjuncts().empty() || !rhs->conjuncts().empty() ||
             lhs->size() + rhs->size() >= kMaxWidth)
             return Any();
 
@@ -485,7 +670,8 @@ namespace {
         if (recursion_depth > kMaxRecursion)
             return Any();
 
-        intrusive_ptr<QueryPlan> out(new QueryPlan(lhs->anchor & rhs->anchor & (kAnchorLeft|kAnchorRight)));
+        intrusive_ptr<QueryPlan> out(new QueryPlan(lhs->anchor & rhs->anchor &
+                                                   (kAnchorLeft|kAnchorRight|kAnchorLineStart)));
         QueryPlan::const_iterator lit, rit;
         lit = lhs->begin();
         rit = rhs->begin();
@@ -533,10 +719,66 @@ namespace {
         return out;
     }
 
+    /*
+     * Combine `groups', each the plan for one or more branches of an
+     * alternation, into a single plan with a branch per group. Nested
+     * disjunctions are flattened. Any group that can't be indexed
+     * makes the whole alternation unindexable.
+     */
+    intrusive_ptr<QueryPlan> Disjunction(const vector<intrusive_ptr<QueryPlan> >& groups) {
+        vector<intrusive_ptr<QueryPlan> > branches;
+        for (auto it = groups.begin(); it != groups.end(); ++it) {
+            if (!*it || (*it)->empty())
+                return Any();
+            if ((*it)->branches().empty())
+                branches.push_back(*it);
+            else
+                branches.insert(branches.end(), (*it)->branches().begin(),
+                                (*it)->branches().end());
+        }
+        if (branches.size() > kMaxBranches)
+            return Any();
+
+        intrusive_ptr<QueryPlan> out(new QueryPlan());
+        for (auto it = branches.begin(); it != branches.end(); ++it) {
+            out->add_branch(*it);
+            if (out->nodes() >= kMaxNodes)
+                return Any();
+        }
+        return out;
+    }
+
+    /*
+     * Merge the branches of an alternation into as few tries as
+     * possible, starting a new group whenever the next branch won't
+     * merge into the current one.
+     */
+    intrusive_ptr<QueryPlan> Alternate(intrusive_ptr<QueryPlan> *children,
+                                       int nchildren) {
+        alternate_cache cache;
+        vector<intrusive_ptr<QueryPlan> > groups;
+        intrusive_ptr<QueryPlan> cur = children[0];
+        for (int i = 1; i < nchildren; i++) {
+            intrusive_ptr<QueryPlan> merged = Alternate(cache, cur, children[i]);
+            if (merged && !merged->empty()) {
+                cur = merged;
+                continue;
+            }
+            groups.push_back(cur);
+            cur = children[i];
+        }
+        if (groups.empty())
+            return cur;
+        groups.push_back(cur);
+        return Disjunction(groups);
+    }
+
 };
 
-intrusive_ptr<QueryPlan> constructQueryPlan(const re2::RE2 &re) {
+intrusive_ptr<QueryPlan> constructQueryPlan(const re2::RE2 &re,
+                                            const corpus_stats *corpus) {
     IndexWalker walk;
+    corpus_scope scope(corpus && !corpus->empty() ? corpus : nullptr);
 
     Regexp *sre = re.Regexp()->Simplify();
     intrusive_ptr<QueryPlan> key = walk.WalkExponential(sre, 0, 10000);
@@ -555,11 +797,15 @@ IndexWalker::PostVisit(Regexp* re, intrusive_ptr<QueryPlan> parent_arg,
     intrusive_ptr<QueryPlan> key;
 
     switch (re->op()) {
+    case kRegexpBeginLine:       // at beginning of line
+    case kRegexpBeginText:       // at beginning of text
+        key = Empty();
+        key->anchor |= kAnchorLineStart;
+        break;
+
     case kRegexpNoMatch:
     case kRegexpEmptyMatch:      // anywhere
-    case kRegexpBeginLine:       // at beginning of line
     case kRegexpEndLine:         // at end of line
-    case kRegexpBeginText:       // at beginning of text
     case kRegexpEndText:         // at end of text
     case kRegexpWordBoundary:    // at word boundary
     case kRegexpNoWordBoundary:  // not at word boundary
@@ -596,12 +842,7 @@ IndexWalker::PostVisit(Regexp* re, intrusive_ptr<QueryPlan> parent_arg,
         break;
 
     case kRegexpAlternate:
-        {
-            alternate_cache cache;
-            key = child_args[0];
-            for (int i = 1; i < nchild_args; i++)
-                key = Alternate(cache, key, child_args[i]);
-        }
+        key = Alternate(child_args, nchild_args);
         break;
 
     case kRegexpStar:
@@ -650,6 +891,12 @@ IndexWalker::ShortVisit(Regexp* re, intrusive_ptr<QueryPlan> parent_arg) {
 }
 
 void QueryPlan::check_rep() {
+    assert(edges_.empty() || branches_.empty());
+    assert(edges_.empty() || conjuncts_.empty());
+    for (auto it = branches_.begin(); it != branches_.end(); ++it)
+        (*it)->check_rep();
+    for (auto it = conjuncts_.begin(); it != conjuncts_.end(); ++it)
+        (*it)->check_rep();
     pair<uchar, uchar> last = make_pair('\0', '\0');
     for (iterator it = begin(); it != end(); ++it) {
         assert(!intersects(last, it->first));
@@ -27,12 +27,17 @@ using std::list;
 using std::set;
 using boost::intrusive_ptr;
 
+class corpus_stats;
+
 enum {
     kAnchorNone   = 0x00,
     kAnchorLeft   = 0x01,
     kAnchorRight  = 0x02,
     kAnchorBoth   = 0x03,
-    kAnchorRepeat = 0x04
+    kAnchorRepeat = 0x04,
+    // Every match of the plan starts at the beginning of a line, so a
+    // search need only consider suffixes that do.
+    kAnchorLineStart = 0x08
 };
 
 class QueryPlan {
@@ -62,8 +67,30 @@ public:
     void insert(const value_type& v);
     void concat(intrusive_ptr<QueryPlan> rhs);
 
+    /*
+     * A plan with branches has no edges of its own; it matches
+     * wherever any one of its branches does. These let an alternation
+     * too wide to merge into a single trie stay indexed, at the cost
+     * of one walk of the suffix array per branch.
+     */
+    void add_branch(intrusive_ptr<QueryPlan> branch);
+    const vector<intrusive_ptr<QueryPlan> >& branches() {
+        return branches_;
+    }
+
+    /*
+     * Likewise, a plan with conjuncts matches only on lines where
+     * every one of its conjuncts does -- for parts of a concatenation
+     * that can't be joined into one trie, like the two sides of
+     * "foo.*bar". The first conjunct is the most selective.
+     */
+    void add_conjunct(intrusive_ptr<QueryPlan> conjunct);
+    const vector<intrusive_ptr<QueryPlan> >& conjuncts() {
+        return conjuncts_;
+    }
+
     bool empty() {
-        return edges_.empty();
+        return edges_.empty() && branches_.empty() && conjuncts_.empty();
     }
 
     size_t size() {
@@ -76,10 +103,17 @@ public:
         int depth_;
         long nodes_;
         long tail_paths_;
+        // If every path starts with the same byte, that byte, and the
+        // byte after it if that is shared too; otherwise -1. These let
+        // an edge inserted in front be weighed by what follows it.
+        int lead_;
+        int lead2_;
 
         Stats();
         Stats insert(const value_type& v) const;
         Stats concat(const Stats& rhs) const;
+        Stats disjoin(const Stats& rhs) const;
+        Stats conjoin(const Stats& rhs) const;
     };
 
     const Stats& stats() {
@@ -96,9 +130,9 @@ public:
      *      selectivity() == 0.1 means that using this index key will
      *      only require searching 1/10th of the corpus.
      *
-     * This value is computed without any reference to the actual
-     * characteristics of any particular corpus, and so is a rough
-     * approximation at best.
+     * Unless the plan was built with a corpus_stats, this value is
+     * computed without any reference to the actual characteristics of
+     * any particular corpus, and so is a rough approximation at best.
      */
     double selectivity();
 
@@ -121,6 +155,8 @@ public:
     void collect_tails(list<QueryPlan::const_iterator>& tails);
 protected:
     std::map<std::pair<uchar, uchar>, intrusive_ptr<QueryPlan> > edges_;
+    vector<intrusive_ptr<QueryPlan> > branches_;
+    vector<intrusive_ptr<QueryPlan> > conjuncts_;
     Stats stats_;
     std::atomic_int refs_;
 
@@ -136,6 +172,12 @@ private:
     friend void intrusive_ptr_release(QueryPlan *key);
 };
 
-intrusive_ptr<QueryPlan> constructQueryPlan(const re2::RE2 &pat);
+/*
+ * If `corpus' is given, selectivities are estimated from its byte,
+ * bigram and trigram frequencies, and the planner weighs the cost of
+ * verifying candidates against that of walking the suffix array.
+ */
+intrusive_ptr<QueryPlan> constructQueryPlan(const re2::RE2 &pat,
+                                            const corpus_stats *corpus = nullptr);
 
 #endif /* CODESEARCH_INDEXER_H */
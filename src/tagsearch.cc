@@ -99,15 +99,11 @@ bool tag_searcher::transform(query *q, match_result *m) const {
     auto file = value->second;
 
     // iterate through the lines to add context information
-    auto line_it = file->content->begin(file_alloc_);
-    auto line_end = file->content->end(file_alloc_);
+    int current = std::max(1, m->lno - q->context_lines);
+    auto line_it = file->content->begin_lines(file_alloc_, current);
+    auto line_end = file->content->end_lines(file_alloc_);
     m->file = file;
 
-    // jump to context before
-    int current = 1;
-    for (;current < std::max(1, m->lno - q->context_lines); ++current)
-        ++line_it;
-
     // context before (we reverse the order to match codesearch)
     m->context_before.clear();
     for (; current < m->lno; ++current) {
@@ -16,6 +16,7 @@
 
 #include "src/dump_load.h"
 #include "src/codesearch.h"
+#include "src/corpus_stats.h"
 #include "src/query_planner.h"
 #include "src/re_width.h"
 
@@ -25,6 +26,7 @@ using namespace std;
 
 DEFINE_string(dot_index, "", "Write a graph of the index key as a dot graph.");
 DEFINE_bool(casefold, false, "Treat the regex as case-insensitive.");
+DEFINE_string(load_index, "", "Plan with the statistics of this index, and count the candidates the plan yields in it.");
 
 class QueryPlanDotOutputter {
 protected:
@@ -60,6 +62,10 @@ protected:
                 continue;
             assign_names(it->second);
         }
+        for (auto it = key->branches().begin(); it != key->branches().end(); it++)
+            assign_names(*it);
+        for (auto it = key->conjuncts().begin(); it != key->conjuncts().end(); it++)
+            assign_names(*it);
     }
 
     void dump(intrusive_ptr<QueryPlan> key) {
@@ -88,6 +94,18 @@ protected:
             if (it->second)
                 dump(it->second);
         }
+        for (auto it = key->branches().begin(); it != key->branches().end(); it++) {
+            out_ << strprintf("  %s -> %s [style=dashed,label=\"or\"]\n",
+                              names_[key.get()].c_str(),
+                              names_[it->get()].c_str());
+            dump(*it);
+        }
+        for (auto it = key->conjuncts().begin(); it != key->conjuncts().end(); it++) {
+            out_ << strprintf("  %s -> %s [style=bold,label=\"and\"]\n",
+                              names_[key.get()].c_str(),
+                              names_[it->get()].c_str());
+            dump(*it);
+        }
     }
 
 public:
@@ -133,13 +151,31 @@ int analyze_re(int argc, char **argv) {
     printf("width: %d\n", width.Walk(re.Regexp(), 0));
     printf("Program size: %d\n", re.ProgramSize());
 
-    intrusive_ptr<QueryPlan> key = constructQueryPlan(re);
+    code_searcher cs;
+    const corpus_stats *corpus = nullptr;
+    if (FLAGS_load_index.size()) {
+        cs.load_index(FLAGS_load_index);
+        corpus = &cs.stats();
+    }
+
+    intrusive_ptr<QueryPlan> key = constructQueryPlan(re, corpus);
     if (key) {
         QueryPlan::Stats stats = key->stats();
         printf("Index key:\n");
         printf("  log10(selectivity): %f\n", log(stats.selectivity_)/log(10));
         printf("  depth: %d\n", stats.depth_);
         printf("  nodes: %ld\n", stats.nodes_);
+        if (!key->branches().empty())
+            printf("  branches: %d\n", int(key->branches().size()));
+        if (!key->conjuncts().empty())
+            printf("  conjuncts: %d\n", int(key->conjuncts().size()));
+        if (key->anchor & kAnchorLineStart)
+            printf("  anchored at line start\n");
+        if (corpus) {
+            printf("  estimated candidates: %.1f\n",
+                   stats.selectivity_ * corpus->bytes());
+            printf("  actual candidates: %ld\n", cs.count_candidates(key));
+        }
 
         if (FLAGS_dot_index.size()) {
             write_dot_index(FLAGS_dot_index, key);
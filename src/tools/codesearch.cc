@@ -16,6 +16,7 @@
 #include "src/re_width.h"
 #include "src/git_indexer.h"
 #include "src/fs_indexer.h"
+#include "src/index_pipeline.h"
 
 #include "src/tools/limits.h"
 #include "src/tools/grpc_server.h"
@@ -45,6 +46,8 @@
 #include <grpc++/server.h>
 #include <grpc++/server_builder.h>
 
+DECLARE_int32(threads);
+
 DEFINE_string(dump_index, "", "Dump the produced index to a specified file");
 DEFINE_string(load_index, "", "Load the index from a file instead of walking the repository");
 DEFINE_string(load_tags, "", "Load the index built from a tags file.");
@@ -93,32 +96,42 @@ void build_index(code_searcher *cs, const vector<std::string> &argv) {
 
     if (spec.name().size())
         cs->set_name(spec.name());
+
+    // Every path and repository is read at once, but indexed in the
+    // order they're listed.
+    index_pipeline pipeline(cs, FLAGS_threads);
     for (auto &path : spec.paths()) {
-        fprintf(stderr, "Walking path_spec name=%s, path=%s\n",
-                path.name().c_str(), path.path().c_str());
-        fs_indexer indexer(cs, path.path(), path.name(), path.metadata(), path.ignore_symlinks());
-        if (path.ordered_contents().empty()) {
-            fprintf(stderr, "  walking full tree\n");
-            indexer.walk(path.path());
-        } else {
-            fprintf(stderr, "  walking paths from ordered contents list\n");
-            fs::path contents_file_path = fs::canonical(path.ordered_contents(),
-                                                        config_file_path.remove_filename());
-            indexer.walk_contents_file(contents_file_path);
-        }
-        fprintf(stderr, "done\n");
+        pipeline.add_source([&path, config_file_path](file_sink *sink) {
+                fprintf(stderr, "Walking path_spec name=%s, path=%s\n",
+                        path.name().c_str(), path.path().c_str());
+                fs_indexer indexer(sink, path.path(), path.name(), path.metadata(), path.ignore_symlinks());
+                if (path.ordered_contents().empty()) {
+                    fprintf(stderr, "  walking full tree\n");
+                    indexer.walk(path.path());
+                } else {
+                    fprintf(stderr, "  walking paths from ordered contents list\n");
+                    fs::path config_dir = config_file_path;
+                    fs::path contents_file_path = fs::canonical(path.ordered_contents(),
+                                                                config_dir.remove_filename());
+                    indexer.walk_contents_file(contents_file_path);
+                }
+                fprintf(stderr, "done\n");
+            });
     }
 
     for (auto &repo  : spec.repositories()) {
-        fprintf(stderr, "Walking repo_spec name=%s, path=%s (including  submodules: %s)\n",
-                repo.name().c_str(), repo.path().c_str(), repo.walk_submodules() ? "true" : "false");
-        git_indexer indexer(cs, repo.path(), repo.name(), repo.metadata(), repo.walk_submodules());
-        for (auto &rev : repo.revisions()) {
-            fprintf(stderr, "  walking %s\n", rev.c_str());
-            indexer.walk(rev);
-            fprintf(stderr, "  done\n");
-        }
+        pipeline.add_source([&repo](file_sink *sink) {
+                fprintf(stderr, "Walking repo_spec name=%s, path=%s (including  submodules: %s)\n",
+                        repo.name().c_str(), repo.path().c_str(), repo.walk_submodules() ? "true" : "false");
+                git_indexer indexer(sink, repo.path(), repo.name(), repo.metadata(), repo.walk_submodules());
+                for (auto &rev : repo.revisions()) {
+                    fprintf(stderr, "  walking %s\n", rev.c_str());
+                    indexer.walk(rev);
+                    fprintf(stderr, "  done\n");
+                }
+            });
     }
+    pipeline.finish();
 }
 
 void initialize_search(code_searcher *search,
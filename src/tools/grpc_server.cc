@@ -1,23 +1,32 @@
 #include "src/lib/debug.h"
+#include "src/lib/metrics.h"
 #include "src/lib/timer.h"
 
 #include "src/codesearch.h"
+#include "src/query_cache.h"
 #include "src/tagsearch.h"
-#include "src/re_width.h"
 
 #include "src/tools/limits.h"
 #include "src/tools/grpc_server.h"
 
 #include "google/protobuf/repeated_field.h"
+#include "google/protobuf/util/json_util.h"
 
 #include "gflags/gflags.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cctype>
+#include <chrono>
+#include <fstream>
 #include <functional>
 #include <future>
+#include <list>
+#include <mutex>
 #include <numeric>
 #include <string>
+#include <thread>
+#include <unordered_map>
 
 #include "utf8.h"
 
@@ -25,6 +34,7 @@
 #include "absl/strings/str_join.h"
 
 using grpc::ServerContext;
+using grpc::ServerWriter;
 using grpc::Status;
 using grpc::StatusCode;
 
@@ -32,6 +42,128 @@ using std::string;
 
 DEFINE_int32(context_lines, 3, "The default number of result context lines to provide for a single query.");
 DEFINE_int32(max_matches, 50, "The default maximum number of matches to return for a single query.");
+DEFINE_int32(result_cache_mb, 0, "Megabytes of complete search responses to cache for repeated queries. 0 disables the cache.");
+DEFINE_int32(result_cache_ttl, 300, "The number of seconds a cached search response may be served for.");
+DEFINE_string(result_cache_warm, "", "A file of JSON-encoded Query messages, one per line, to search for in the background at startup to fill the result cache.");
+DEFINE_int32(session_cache_size, 1024, "Number of client sessions whose last literal search's candidates are kept for type-ahead refinement. 0 disables refinement.");
+
+namespace {
+    metric result_cache_hits("result_cache.hits");
+    metric result_cache_misses("result_cache.misses");
+    metric session_refinements("session_cache.refinements");
+};
+
+class add_match;
+
+/*
+ * Complete responses to recent searches, keyed by the canonicalized
+ * Query together with the identity of the index that answered it.
+ * Entries expire after a fixed time, and the least recently used are
+ * evicted to keep the total size of the responses under a budget.
+ *
+ * Each CodeSearchImpl owns its own cache, so a reload, which builds
+ * a new service for the new index, starts from an empty one.
+ */
+class result_cache {
+public:
+    result_cache(size_t max_bytes, std::chrono::seconds ttl)
+        : max_bytes_(max_bytes), ttl_(ttl), bytes_(0) {}
+
+    bool get(const string &key, CodeSearchResult *out) {
+        std::unique_lock<std::mutex> locked(mtx_);
+        auto it = index_.find(key);
+        if (it == index_.end())
+            return false;
+        if (it->second->expires < std::chrono::steady_clock::now()) {
+            erase(it->second);
+            return false;
+        }
+        lru_.splice(lru_.begin(), lru_, it->second);
+        *out = it->second->result;
+        return true;
+    }
+
+    void put(const string &key, const CodeSearchResult &result) {
+        size_t bytes = key.size() + result.ByteSizeLong();
+        if (bytes > max_bytes_)
+            return;
+
+        std::unique_lock<std::mutex> locked(mtx_);
+        auto it = index_.find(key);
+        if (it != index_.end())
+            erase(it->second);
+        while (bytes_ + bytes > max_bytes_)
+            erase(std::prev(lru_.end()));
+
+        lru_.push_front((entry){
+                key, result, bytes, std::chrono::steady_clock::now() + ttl_});
+        index_[key] = lru_.begin();
+        bytes_ += bytes;
+    }
+
+private:
+    struct entry {
+        string key;
+        CodeSearchResult result;
+        size_t bytes;
+        std::chrono::steady_clock::time_point expires;
+    };
+
+    void erase(std::list<entry>::iterator it) {
+        bytes_ -= it->bytes;
+        index_.erase(it->key);
+        lru_.erase(it);
+    }
+
+    size_t max_bytes_;
+    std::chrono::seconds ttl_;
+    std::mutex mtx_;
+    std::list<entry> lru_;
+    std::unordered_map<string, std::list<entry>::iterator> index_;
+    size_t bytes_;
+};
+
+/*
+ * The candidate_set of the most recent literal search made by each of
+ * the last few client sessions, so that a session typing out a query
+ * one keystroke at a time can narrow its previous search rather than
+ * start over.
+ */
+class session_cache {
+public:
+    explicit session_cache(size_t capacity) : capacity_(capacity) {}
+
+    std::shared_ptr<candidate_set> get(const string &session) {
+        std::unique_lock<std::mutex> locked(mtx_);
+        auto it = index_.find(session);
+        if (it == index_.end())
+            return nullptr;
+        lru_.splice(lru_.begin(), lru_, it->second);
+        return it->second->second;
+    }
+
+    void put(const string &session, std::shared_ptr<candidate_set> set) {
+        std::unique_lock<std::mutex> locked(mtx_);
+        auto it = index_.find(session);
+        if (it != index_.end()) {
+            lru_.erase(it->second);
+            index_.erase(it);
+        } else if (lru_.size() >= capacity_) {
+            index_.erase(lru_.back().first);
+            lru_.pop_back();
+        }
+        lru_.push_front(std::make_pair(session, set));
+        index_[session] = lru_.begin();
+    }
+
+private:
+    typedef std::list<std::pair<string, std::shared_ptr<candidate_set>>> lru_list;
+
+    size_t capacity_;
+    std::mutex mtx_;
+    lru_list lru_;
+    std::unordered_map<string, lru_list::iterator> index_;
+};
 
 class CodeSearchImpl final : public CodeSearch::Service {
  public:
@@ -39,17 +171,28 @@ class CodeSearchImpl final : public CodeSearch::Service {
     virtual ~CodeSearchImpl();
 
     virtual grpc::Status Info(grpc::ServerContext* context, const ::InfoRequest* request, ::ServerInfo* response);
-    void TagsFirstSearch_(::CodeSearchResult* response, query& q, match_stats& stats);
+    void TagsFirstSearch_(add_match& cb, query& q, match_stats& stats);
     virtual grpc::Status Search(grpc::ServerContext* context, const ::Query* request, ::CodeSearchResult* response);
+    virtual grpc::Status StreamSearch(grpc::ServerContext* context, const ::Query* request, grpc::ServerWriter< ::CodeSearchResult>* writer);
     virtual grpc::Status Reload(grpc::ServerContext* context, const ::Empty* request, ::Empty* response);
 
  private:
+    grpc::Status DoSearch_(grpc::ServerContext* context, const ::Query* request, ::CodeSearchResult* response, grpc::ServerWriter< ::CodeSearchResult>* writer);
+    grpc::Status Search_(const ::Query* request, ::CodeSearchResult* response,
+                         grpc::ServerWriter< ::CodeSearchResult>* writer,
+                         const std::function<void (query&)>& prepare);
+    string CacheKey_(const ::Query* request);
+    void WarmCache_(const string &path);
+    void Refine_(grpc::ServerContext* context, query& q);
+
     code_searcher *cs_;
     code_searcher *tagdata_;
     std::promise<void> *reload_request_;
     tag_searcher *tagmatch_;
-
-    thread_queue <code_searcher::search_thread*> pool_;
+    std::unique_ptr<result_cache> results_;
+    std::unique_ptr<session_cache> sessions_;
+    std::thread warm_;
+    std::atomic<bool> stopping_;
 };
 
 std::unique_ptr<CodeSearch::Service> build_grpc_server(code_searcher *cs,
@@ -59,18 +202,105 @@ std::unique_ptr<CodeSearch::Service> build_grpc_server(code_searcher *cs,
 }
 
 CodeSearchImpl::CodeSearchImpl(code_searcher *cs, code_searcher *tagdata, std::promise<void> *reload_request)
-    : cs_(cs), tagdata_(tagdata), reload_request_(reload_request), tagmatch_(nullptr) {
+    : cs_(cs), tagdata_(tagdata), reload_request_(reload_request), tagmatch_(nullptr),
+      stopping_(false) {
     if (tagdata != nullptr) {
         tagmatch_ = new tag_searcher;
         tagmatch_->cache_indexed_files(cs_);
     }
+    if (FLAGS_result_cache_mb > 0) {
+        results_.reset(new result_cache(size_t(FLAGS_result_cache_mb) << 20,
+                                        std::chrono::seconds(FLAGS_result_cache_ttl)));
+    }
+    if (FLAGS_session_cache_size > 0)
+        sessions_.reset(new session_cache(FLAGS_session_cache_size));
+    // Warm the cache in the background, so the server can start
+    // answering requests meanwhile.
+    if (results_ && !FLAGS_result_cache_warm.empty())
+        warm_ = std::thread(&CodeSearchImpl::WarmCache_, this, FLAGS_result_cache_warm);
+}
+
+/*
+ * Requests that differ only in ways that cannot change the response
+ * -- the time limit, or spelling out a default -- share a key.
+ */
+string CodeSearchImpl::CacheKey_(const ::Query* request) {
+    Query canon(*request);
+    canon.clear_timeout_ms();
+    if (canon.max_matches() == 0)
+        canon.set_max_matches(FLAGS_max_matches);
+    else if (canon.max_matches() < 0)
+        canon.set_max_matches(-1);
+    if (canon.context_lines() <= 0)
+        canon.set_context_lines(FLAGS_context_lines);
+
+    string key = cs_->name();
+    key += '\0';
+    key += std::to_string(cs_->index_timestamp());
+    key += '\0';
+    key += canon.SerializeAsString();
+    return key;
+}
+
+static void set_deadline(query *q, std::chrono::system_clock::time_point deadline) {
+    if (deadline != std::chrono::system_clock::time_point::max()) {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+            deadline.time_since_epoch()).count();
+        q->deadline.tv_sec = us / 1000000;
+        q->deadline.tv_usec = us % 1000000;
+    }
+}
+
+static void set_deadline(query *q, ServerContext *ctx, const ::Query* request) {
+    auto deadline = ctx->deadline();
+    if (request->timeout_ms() > 0) {
+        deadline = std::min(deadline,
+                            std::chrono::system_clock::now() +
+                            std::chrono::milliseconds(request->timeout_ms()));
+    }
+    set_deadline(q, deadline);
+    q->cancelled = [ctx] { return ctx->IsCancelled(); };
+}
+
+void CodeSearchImpl::WarmCache_(const string &path) {
+    std::ifstream in(path);
+    if (!in) {
+        log(current_trace_id(), "unable to open result cache warm file %s", path.c_str());
+        return;
+    }
+    int warmed = 0;
+    string line;
+    while (!stopping_ && std::getline(in, line)) {
+        if (line.empty() || line[0] == '#')
+            continue;
+        Query request;
+        auto status = google::protobuf::util::JsonStringToMessage(
+            line, &request, google::protobuf::util::JsonParseOptions());
+        if (!status.ok()) {
+            log(current_trace_id(), "result cache warm: bad query %s: %s",
+                line.c_str(), status.ToString().c_str());
+            continue;
+        }
+        // Warm-up searches serve no call, so only the request's own
+        // time limit applies to them, and only shutting down cancels
+        // them.
+        CodeSearchResult response;
+        Status st = Search_(&request, &response, nullptr, [this, &request](query &q) {
+                if (request.timeout_ms() > 0)
+                    set_deadline(&q, std::chrono::system_clock::now() +
+                                 std::chrono::milliseconds(request.timeout_ms()));
+                q.cancelled = [this] { return bool(stopping_); };
+            });
+        if (st.ok())
+            ++warmed;
+    }
+    log("result cache warmed with %d queries", warmed);
 }
 
 CodeSearchImpl::~CodeSearchImpl() {
-    pool_.close();
-    code_searcher::search_thread* thread;
-    while (pool_.pop(&thread))
-        delete thread;
+    stopping_ = true;
+    if (warm_.joinable())
+        warm_.join();
     delete tagmatch_;
 }
 
@@ -81,6 +311,36 @@ string trace_id_from_request(ServerContext *ctx) {
     return string(it->second.data(), it->second.size());
 }
 
+string session_from_request(ServerContext *ctx) {
+    auto it = ctx->client_metadata().find("session-id");
+    if (it == ctx->client_metadata().end())
+        return string("");
+    return string(it->second.data(), it->second.size());
+}
+
+/*
+ * If the client names a session, narrow this search to the candidates
+ * of the session's previous search when it can, and otherwise
+ * remember this search's candidates for the session's next one.
+ */
+void CodeSearchImpl::Refine_(ServerContext* context, query& q) {
+    if (!sessions_)
+        return;
+    string session = session_from_request(context);
+    if (session.empty())
+        return;
+
+    auto prev = sessions_->get(session);
+    if (prev && prev->refined_by(*q.line_pat)) {
+        session_refinements.inc();
+        q.refine = prev;
+        return;
+    }
+    q.record = candidate_set::for_pattern(*q.line_pat);
+    if (q.record)
+        sessions_->put(session, q.record);
+}
+
 Status CodeSearchImpl::Info(ServerContext* context, const ::InfoRequest* request, ::ServerInfo* response) {
     scoped_trace_id trace(trace_id_from_request(context));
     log("Info()");
@@ -111,7 +371,7 @@ Status extract_regex(std::shared_ptr<RE2> *out,
     default_re2_options(opts);
     opts.set_case_sensitive(case_sensitive);
 
-    std::shared_ptr<RE2> re(new RE2(input, opts));
+    std::shared_ptr<RE2> re = query_cache::shared()->compile(input, opts);
     if (!re->ok()) {
         return Status(StatusCode::INVALID_ARGUMENT, label + ": " + re->error());
     }
@@ -145,7 +405,7 @@ Status extract_regexes(vector<std::shared_ptr<RE2>> *out,
 
     out->reserve(inputs.size());
     for (const auto &input : inputs) {
-        std::shared_ptr<RE2> re(new RE2(input, opts));
+        std::shared_ptr<RE2> re = query_cache::shared()->compile(input, opts);
         if (!re->ok()) {
             return Status(StatusCode::INVALID_ARGUMENT, label + ": " + re->error());
         }
@@ -167,6 +427,10 @@ Status extract_regexes(vector<std::shared_ptr<RE2>> *out,
     return extract_regexes(out, label, inputs, case_sensitive);
 }
 
+/*
+ * The search stops at the earlier of the call's deadline and the
+ * query's own timeout_ms, and as soon as the client goes away.
+ */
 Status parse_query(query *q, const ::Query* request, ::CodeSearchResult* response) {
     Status status = Status::OK;
     status = extract_regex(&q->line_pat, "line", request->line(), !request->fold_case());
@@ -202,11 +466,34 @@ class add_match {
 public:
     typedef std::set<std::pair<indexed_file*, int>> line_set;
 
-    add_match(line_set* ls, CodeSearchResult* response)
-        : unique_lines_(ls), response_(response) {}
+    /*
+     * When streaming, results are written out to `writer' in batches
+     * of kStreamBatch and cleared from the response. Once a write
+     * fails the client is gone, and `ok' stops the search. The state lives
+     * outside add_match because the search makes copies of it.
+     */
+    struct stream {
+        ServerWriter<CodeSearchResult>* writer;
+        int flushed;
+        std::atomic<bool> ok;
+    };
+
+    add_match(line_set* ls, CodeSearchResult* response, stream* out = nullptr)
+        : unique_lines_(ls), response_(response), out_(out) {}
 
     int match_count() {
-        return response_->results_size();
+        return response_->results_size() + (out_ ? out_->flushed : 0);
+    }
+
+    void flush() const {
+        if (out_ == nullptr ||
+            (response_->results_size() == 0 && response_->file_results_size() == 0))
+            return;
+        if (out_->ok)
+            out_->ok = out_->writer->Write(*response_);
+        out_->flushed += response_->results_size();
+        response_->clear_results();
+        response_->clear_file_results();
     }
 
     void operator()(const match_result *m) const {
@@ -231,6 +518,7 @@ public:
         result->mutable_bounds()->set_left(m->matchleft);
         result->mutable_bounds()->set_right(m->matchright);
         result->set_line(string(m->line));
+        maybe_flush();
     }
 
     void operator()(const file_result *f) const {
@@ -240,11 +528,19 @@ public:
         result->set_path(f->file->path);
         result->mutable_bounds()->set_left(f->matchleft);
         result->mutable_bounds()->set_right(f->matchright);
+        maybe_flush();
     }
 
 private:
+    void maybe_flush() const {
+        if (out_ != nullptr &&
+            response_->results_size() + response_->file_results_size() >= kStreamBatch)
+            flush();
+    }
+
     line_set* unique_lines_;
     CodeSearchResult* response_;
+    stream* out_;
 };
 
 static void run_tags_search(const query& main_query, std::string regex,
@@ -253,7 +549,9 @@ static void run_tags_search(const query& main_query, std::string regex,
     // copy of the main query that we will edit into a query of the tags
     // file for the pattern `regex`
     query q = main_query;
-    q.line_pat.reset(new RE2(regex, q.line_pat->options()));
+    q.line_pat = query_cache::shared()->compile(regex, q.line_pat->options());
+    q.refine.reset();
+    q.record.reset();
 
     // the negation constraints will be checked when we transform the match
     // (unfortunately, we can't construct a line query that checks these)
@@ -264,7 +562,7 @@ static void run_tags_search(const query& main_query, std::string regex,
 
     // modify the line pattern to match the constraints that we can handle now
     regex = tag_searcher::create_tag_line_regex_from_query(&q);
-    q.line_pat.reset(new RE2(regex, q.line_pat->options()));
+    q.line_pat = query_cache::shared()->compile(regex, q.line_pat->options());
     q.file_pats.clear();
     q.tags_pat.reset();
 
@@ -293,14 +591,11 @@ static std::string pat(const vector<std::shared_ptr<RE2>> &ps) {
     return absl::StrJoin(pats, ",");
 }
 
-void CodeSearchImpl::TagsFirstSearch_(::CodeSearchResult* response, query& q, match_stats& stats) {
+void CodeSearchImpl::TagsFirstSearch_(add_match& cb, query& q, match_stats& stats) {
     string line_pat = q.line_pat->pattern();
     string regex;
     int32_t original_max_matches = q.max_matches;  // remember original value
 
-    add_match::line_set ls;
-    add_match cb(&ls, response);
-
     /* To surface the most important matches first, start with tags.
        First pass: is the pattern an exact match for any tags? */
     regex = "^" + line_pat + "$";
@@ -319,17 +614,63 @@ void CodeSearchImpl::TagsFirstSearch_(::CodeSearchResult* response, query& q, ma
         return;
 
     /* Third and final pass: full corpus search. */
-    code_searcher::search_thread *search;
-    if (!pool_.try_pop(&search))
-        search = new code_searcher::search_thread(cs_);
-    search->match(q, cb, cb, &stats);
-    pool_.push(search);
+    code_searcher::search_thread search(cs_);
+    search.match(q, cb, cb, &stats);
 }
 
 Status CodeSearchImpl::Search(ServerContext* context, const ::Query* request, ::CodeSearchResult* response) {
-    WidthWalker width;
+    return DoSearch_(context, request, response, nullptr);
+}
 
+Status CodeSearchImpl::StreamSearch(ServerContext* context, const ::Query* request, ServerWriter< ::CodeSearchResult>* writer) {
+    CodeSearchResult response;
+    Status st = DoSearch_(context, request, &response, writer);
+    if (!st.ok())
+        return st;
+    if (!writer->Write(response)) {
+        log(current_trace_id(), "client went away before the last batch");
+        return Status(StatusCode::CANCELLED, "Search cancelled");
+    }
+    return Status::OK;
+}
+
+Status CodeSearchImpl::DoSearch_(ServerContext* context, const ::Query* request, ::CodeSearchResult* response, ServerWriter< ::CodeSearchResult>* writer) {
     scoped_trace_id trace(trace_id_from_request(context));
+    return Search_(request, response, writer, [this, context, request](query &q) {
+            set_deadline(&q, context, request);
+            Refine_(context, q);
+        });
+}
+
+/*
+ * Runs the search for `request', without reference to any call it
+ * serves: `prepare' applies the call's deadline, cancellation and
+ * session to the query before it runs.
+ */
+Status CodeSearchImpl::Search_(const ::Query* request, ::CodeSearchResult* response,
+                               ServerWriter< ::CodeSearchResult>* writer,
+                               const std::function<void (query&)>& prepare) {
+    // Only successful, complete searches are cached, so a hit can skip
+    // validation as well as the search itself.
+    string cache_key;
+    if (results_) {
+        cache_key = CacheKey_(request);
+        timer lookup_tm(true);
+        if (results_->get(cache_key, response)) {
+            lookup_tm.pause();
+            // The cached stats timed the search that filled the cache;
+            // report the time this lookup took instead.
+            auto out_stats = response->mutable_stats();
+            SearchStats::ExitReason why = out_stats->exit_reason();
+            out_stats->Clear();
+            out_stats->set_exit_reason(why);
+            out_stats->set_total_time(timeval_ms(lookup_tm.elapsed()));
+            result_cache_hits.inc();
+            log(current_trace_id(), "serving query line='%s' from the result cache", request->line().c_str());
+            return Status::OK;
+        }
+        result_cache_misses.inc();
+    }
 
     response->set_index_name(cs_->name());
     response->set_index_time(cs_->index_timestamp());
@@ -377,7 +718,7 @@ Status CodeSearchImpl::Search(ServerContext* context, const ::Query* request, ::
         return Status(StatusCode::INVALID_ARGUMENT, "Parse error");
     }
 
-    int w = width.Walk(q.line_pat->Regexp(), 0);
+    int w = query_cache::shared()->width(q.line_pat);
     if (w > kMaxWidth) {
         log("program too wide width=%d", w);
         return Status(StatusCode::INVALID_ARGUMENT, "Parse error");
@@ -400,28 +741,39 @@ Status CodeSearchImpl::Search(ServerContext* context, const ::Query* request, ::
         && line_pat.back() != '$'
         ;
 
+    if (q.tags_pat != NULL && tagdata_ == NULL)
+        return Status(StatusCode::FAILED_PRECONDITION, "No tags file available.");
+
+    prepare(q);
+
+    add_match::line_set ls;
+    add_match::stream out = {writer, 0, true};
+    add_match cb(&ls, response, writer ? &out : nullptr);
+    if (writer) {
+        // Stop starting on new chunks once a batch is waiting behind a
+        // slow client, and stop as soon as a write fails.
+        q.max_pending = kStreamBatch;
+        std::function<bool ()> cancelled = q.cancelled;
+        q.cancelled = [cancelled, &out] { return !out.ok || (cancelled && cancelled()); };
+    }
+
     match_stats stats;
     timer search_tm(true);
     if (q.tags_pat == NULL && tagdata_ && might_match_tags) {
-        CodeSearchImpl::TagsFirstSearch_(response, q, stats);
+        CodeSearchImpl::TagsFirstSearch_(cb, q, stats);
     } else if (q.tags_pat == NULL) {
-        code_searcher::search_thread *search;
-        if (!pool_.try_pop(&search))
-            search = new code_searcher::search_thread(cs_);
-        add_match::line_set ls;
-        add_match cb(&ls, response);
-        search->match(q, cb, cb, &stats);
-        pool_.push(search);
+        code_searcher::search_thread search(cs_);
+        search.match(q, cb, cb, &stats);
     } else {
-        if (tagdata_ == NULL)
-            return Status(StatusCode::FAILED_PRECONDITION, "No tags file available.");
-
-        add_match::line_set ls;
-        add_match cb(&ls, response);
         run_tags_search(q, line_pat, tagdata_, cb, tagmatch_, stats);
     }
     search_tm.pause();
 
+    if (stats.why == kExitCancelled) {
+        log(q.trace_id, "search cancelled by client");
+        return Status(StatusCode::CANCELLED, "Search cancelled");
+    }
+
     auto out_stats = response->mutable_stats();
     out_stats->set_re2_time(timeval_ms(stats.re2_time));
     out_stats->set_git_time(timeval_ms(stats.git_time));
@@ -439,8 +791,15 @@ Status CodeSearchImpl::Search(ServerContext* context, const ::Query* request, ::
     case kExitTimeout:
         out_stats->set_exit_reason(SearchStats::TIMEOUT);
         break;
+    case kExitCancelled:
+        break;
     }
 
+    // Streamed responses have already been handed off in pieces, and
+    // timed-out searches may be missing results a retry would find.
+    if (results_ && writer == nullptr && stats.why != kExitTimeout)
+        results_->put(cache_key, *response);
+
     return Status::OK;
 }
 
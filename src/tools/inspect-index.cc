@@ -15,6 +15,8 @@
 
 #include "src/dump_load.h"
 #include "src/codesearch.h"
+#include "src/chunk.h"
+#include "src/corpus_stats.h"
 
 #include <gflags/gflags.h>
 
@@ -88,9 +90,27 @@ int inspect_index(int argc, char **argv) {
     printf(" Trees: %d\n", idx->ntrees);
     printf(" Files: %d\n", idx->nfiles);
     printf(" File size: %ld (%0.2fM)\n", st.st_size, st.st_size / double(1 << 20));
-    printf(" Chunks: %d (%dM) (%dM indexes)\n", idx->nchunks,
-           (idx->nchunks * idx->chunk_size) >> 20,
-           (idx->nchunks * idx->chunk_size) >> 18);
+    bool fm = idx->flags & kIndexFMIndex;
+    chunk_header *chunks = reinterpret_cast<chunk_header*>
+        (map + idx->chunks_off);
+    unsigned long index_size = (unsigned long)(idx->nchunks) * idx->chunk_size * 4;
+    bool trigrams = idx->flags & kIndexTrigrams;
+    if (fm) {
+        index_size = idx->nchunks * fm_index::bytes(idx->chunk_size);
+    } else if (trigrams) {
+        index_size = 0;
+        for (int i = 0; i < idx->nchunks; i++)
+            index_size += chunks[i].ntrigram_bytes;
+    } else if (idx->sparse) {
+        index_size = 0;
+        for (int i = 0; i < idx->nchunks; i++)
+            index_size += sizeof(uint32_t) * chunks[i].nsuffixes;
+    }
+    printf(" Chunk index: %s\n", fm ? "FM-index" :
+           trigrams ? "trigram index" :
+           idx->sparse ? "sparse suffix array" : "suffix array");
+    printf(" Chunks: %d (%dM) (%ldM indexes)\n", idx->nchunks,
+           (idx->nchunks * idx->chunk_size) >> 20, index_size >> 20);
     unsigned long content_size = 0;
     content_chunk_header *chdrs = reinterpret_cast<content_chunk_header*>
         (map + idx->content_off);
@@ -119,8 +139,6 @@ int inspect_index(int argc, char **argv) {
            (p - (map + idx->files_off))/double(1<<20));
 
     unsigned long chunk_file_size = 0;
-    chunk_header *chunks = reinterpret_cast<chunk_header*>
-        (map + idx->chunks_off);
     spans.push_back(index_span(idx->chunks_off,
                                idx->chunks_off + idx->nchunks * sizeof(chunk_header),
                                "chunk headers" ));
@@ -128,10 +146,36 @@ int inspect_index(int argc, char **argv) {
         spans.push_back(index_span(chunks[i].data_off,
                                    chunks[i].data_off + idx->chunk_size,
                                    strprintf("chunk %d", i)));
-        spans.push_back(index_span(chunks[i].data_off + idx->chunk_size,
-                                   chunks[i].data_off +
-                                   (1 + sizeof(uint32_t)) * idx->chunk_size,
-                                   strprintf("chunk %d indexes", i)));
+        if (fm) {
+            spans.push_back(index_span(chunks[i].data_off + idx->chunk_size,
+                                       chunks[i].data_off + idx->chunk_size +
+                                       fm_index::bytes(chunks[i].size),
+                                       strprintf("chunk %d FM-index", i)));
+        } else if (trigrams) {
+            spans.push_back(index_span(chunks[i].trigrams_off,
+                                       chunks[i].trigrams_off + chunks[i].ntrigram_bytes,
+                                       strprintf("chunk %d trigram index", i)));
+        } else if (idx->sparse) {
+            spans.push_back(index_span(chunks[i].data_off + idx->chunk_size,
+                                       chunks[i].data_off + idx->chunk_size +
+                                       sizeof(uint32_t) * kPrefixBuckets,
+                                       strprintf("chunk %d prefix buckets", i)));
+            spans.push_back(index_span(chunks[i].suffixes_off,
+                                       chunks[i].suffixes_off +
+                                       sizeof(uint32_t) * chunks[i].nsuffixes,
+                                       strprintf("chunk %d sparse suffixes", i)));
+        } else {
+            spans.push_back(index_span(chunks[i].data_off + idx->chunk_size,
+                                       chunks[i].data_off +
+                                       (1 + sizeof(uint32_t)) * idx->chunk_size,
+                                       strprintf("chunk %d indexes", i)));
+            spans.push_back(index_span(chunks[i].data_off +
+                                       (1 + sizeof(uint32_t)) * idx->chunk_size,
+                                       chunks[i].data_off +
+                                       (1 + sizeof(uint32_t)) * idx->chunk_size +
+                                       sizeof(uint32_t) * kPrefixBuckets,
+                                       strprintf("chunk %d prefix buckets", i)));
+        }
         p = map + chunks[i].files_off;
         for (int j = 0; j < chunks[i].nfiles; ++j) {
             uint32_t files = *reinterpret_cast<uint32_t*>(p);
@@ -148,6 +192,10 @@ int inspect_index(int argc, char **argv) {
            chunk_file_size,
            chunk_file_size / double(1 << 20));
 
+    spans.push_back(index_span(idx->stats_off,
+                               idx->stats_off + sizeof(corpus_stats),
+                               "corpus statistics"));
+
     code_searcher cs;
     if (FLAGS_dump_trees) {
         cs.load_index(argv[0]);
@@ -3,5 +3,6 @@
 
 const int kMaxProgramSize = 4000;
 const int kMaxWidth       = 200;
+const int kStreamBatch    = 100;
 
 #endif
@@ -0,0 +1,254 @@
+/********************************************************************
+ * livegrep -- trigram_index.cc
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#include "src/trigram_index.h"
+
+#include <algorithm>
+#include <functional>
+#include <queue>
+
+// How many (trigram, line) pairs build() sorts at a time.
+static const size_t kBlockPairs = 1 << 22;
+
+static void put_varint(std::vector<uint8_t> *out, uint32_t v) {
+    while (v >= 0x80) {
+        out->push_back(uint8_t(v) | 0x80);
+        v >>= 7;
+    }
+    out->push_back(uint8_t(v));
+}
+
+static const uint8_t *get_varint(const uint8_t *p, uint32_t *v) {
+    uint32_t val = 0;
+    int shift = 0;
+    while (*p & 0x80) {
+        val |= uint32_t(*p++ & 0x7f) << shift;
+        shift += 7;
+    }
+    *v = val | uint32_t(*p++) << shift;
+    return p;
+}
+
+namespace {
+    /*
+     * The posting lists of a run of consecutive lines: the keys of
+     * the trigrams that occur on them, sorted, and each one's list of
+     * lines, encoded as in the index.
+     */
+    struct posting_block {
+        std::vector<uint32_t> keys;
+        std::vector<uint32_t> offsets;
+        std::vector<uint8_t> lists;
+    };
+
+    /*
+     * Sorts `pairs', (key, line) pairs in order of line, into order of
+     * key, with an LSD radix sort on the key's three bytes. The sort is
+     * stable, so each key's lines stay in order.
+     */
+    void sort_pairs(std::vector<uint64_t> *pairs, std::vector<uint64_t> *scratch) {
+        scratch->resize(pairs->size());
+        for (int shift = 32; shift < 56; shift += 8) {
+            size_t count[257] = {0};
+            for (uint64_t p : *pairs)
+                count[((p >> shift) & 0xff) + 1]++;
+            for (int i = 1; i < 257; i++)
+                count[i] += count[i - 1];
+            for (uint64_t p : *pairs)
+                (*scratch)[count[(p >> shift) & 0xff]++] = p;
+            pairs->swap(*scratch);
+        }
+    }
+
+    // Encodes `pairs', sorted (key, line) pairs, as a posting_block.
+    void encode_block(const std::vector<uint64_t> &pairs, posting_block *out) {
+        // Most deltas take a byte or two.
+        out->lists.reserve(pairs.size() * 2);
+        uint32_t prev = 0;
+        for (size_t i = 0; i < pairs.size(); i++) {
+            // A trigram that occurs more than once on a line is listed
+            // once.
+            if (i && pairs[i] == pairs[i - 1])
+                continue;
+            uint32_t key = pairs[i] >> 32, line = uint32_t(pairs[i]);
+            if (out->keys.empty() || out->keys.back() != key) {
+                out->keys.push_back(key);
+                out->offsets.push_back(out->lists.size());
+                prev = 0;
+            }
+            put_varint(&out->lists, line - prev);
+            prev = line;
+        }
+        out->offsets.push_back(out->lists.size());
+        out->keys.shrink_to_fit();
+        out->offsets.shrink_to_fit();
+        out->lists.shrink_to_fit();
+    }
+};
+
+/*
+ * Calls `f' with every trigram of data[0, size) that lies within a
+ * line, and the start of that line, in order of position.
+ */
+template <class F>
+static void each_trigram(const unsigned char *data, uint32_t size, F f) {
+    uint32_t line = 0;
+    for (uint32_t i = 0; i + 2 < size; i++) {
+        if (data[i] == '\n') {
+            line = i + 1;
+            continue;
+        }
+        if (data[i + 1] == '\n' || data[i + 2] == '\n')
+            continue;
+        f(trigram_index::key(data[i], data[i + 1], data[i + 2]), line);
+    }
+}
+
+void trigram_index::build(const unsigned char *data, uint32_t size) {
+    // Sort the (trigram, line) pairs of a block of lines at a time,
+    // which bounds the memory the sort needs. Each block's lines come
+    // after the last block's, so a trigram's list is its lists from
+    // every block in turn.
+    std::vector<posting_block> blocks;
+    std::vector<uint64_t> pairs, scratch;
+    // Leave room for the rest of the line that fills a block, however
+    // long any line --line_limit lets through.
+    pairs.reserve(std::min(size_t(size), kBlockPairs + (1 << 16)));
+    auto flush = [&] {
+        sort_pairs(&pairs, &scratch);
+        blocks.emplace_back();
+        encode_block(pairs, &blocks.back());
+        pairs.clear();
+    };
+    each_trigram(data, size, [&](uint32_t key, uint32_t line) {
+            // Only start a new block with a new line, so that no line
+            // is split between blocks.
+            if (pairs.size() >= kBlockPairs && uint32_t(pairs.back()) != line)
+                flush();
+            pairs.push_back(uint64_t(key) << 32 | line);
+        });
+    flush();
+    pairs.clear();
+    pairs.shrink_to_fit();
+    scratch.clear();
+    scratch.shrink_to_fit();
+
+    // Walks each block's lists, in order of key and then of block.
+    auto merge = [&blocks](const std::function<void (uint32_t, const posting_block&, size_t)> &f) {
+        typedef std::pair<uint32_t, size_t> head;
+        std::priority_queue<head, std::vector<head>, std::greater<head>> heads;
+        std::vector<size_t> next(blocks.size(), 0);
+        for (size_t b = 0; b < blocks.size(); b++) {
+            if (!blocks[b].keys.empty())
+                heads.push(head(blocks[b].keys[0], b));
+        }
+        while (!heads.empty()) {
+            size_t b = heads.top().second;
+            heads.pop();
+            f(blocks[b].keys[next[b]], blocks[b], next[b]);
+            if (++next[b] < blocks[b].keys.size())
+                heads.push(head(blocks[b].keys[next[b]], b));
+        }
+    };
+
+    uint32_t ntrigrams = 0, last = 0;
+    size_t total = 0;
+    merge([&](uint32_t key, const posting_block &block, size_t k) {
+            if (!ntrigrams || key != last)
+                ntrigrams++;
+            last = key;
+            total += block.offsets[k + 1] - block.offsets[k];
+        });
+
+    // Lay out the header, then the lists, re-encoding the first line
+    // each block adds to a list as a delta from the last one before
+    // it, which can only make the lists shorter.
+    size_t header = sizeof(uint32_t) * (1 + 2 * ntrigrams + 1);
+    data_.reserve(header + total);
+    data_.assign(header, 0);
+    uint32_t *words = reinterpret_cast<uint32_t*>(data_.data());
+    words[0] = ntrigrams;
+    uint32_t i = 0, prev = 0;
+    merge([&](uint32_t key, const posting_block &block, size_t k) {
+            if (!i || key != words[i]) {
+                words[1 + i] = key;
+                words[1 + ntrigrams + i] = data_.size() - header;
+                i++;
+                prev = 0;
+            }
+            uint32_t line = 0, delta;
+            const uint8_t *p = block.lists.data() + block.offsets[k];
+            const uint8_t *end = block.lists.data() + block.offsets[k + 1];
+            while (p < end) {
+                p = get_varint(p, &delta);
+                line += delta;
+                put_varint(&data_, line - prev);
+                prev = line;
+            }
+        });
+    words[1 + ntrigrams + i] = data_.size() - header;
+    data_.shrink_to_fit();
+    load(data_.data(), data_.size());
+}
+
+void trigram_index::load(const uint8_t *storage, size_t bytes) {
+    storage_ = storage;
+    bytes_ = bytes;
+    const uint32_t *words = reinterpret_cast<const uint32_t*>(storage);
+    ntrigrams_ = words[0];
+    keys_ = words + 1;
+    offsets_ = keys_ + ntrigrams_;
+    lists_ = reinterpret_cast<const uint8_t*>(offsets_ + ntrigrams_ + 1);
+}
+
+int trigram_index::find(uint32_t key) const {
+    const uint32_t *it = std::lower_bound(keys_, keys_ + ntrigrams_, key);
+    if (it == keys_ + ntrigrams_ || *it != key)
+        return -1;
+    return it - keys_;
+}
+
+const uint8_t *trigram_index::list(int i) const {
+    return lists_ + offsets_[i];
+}
+
+const uint8_t *trigram_index::list_end(int i) const {
+    return lists_ + offsets_[i + 1];
+}
+
+void trigram_index::postings(uint32_t key, std::vector<uint32_t> *out) const {
+    out->clear();
+    int i = find(key);
+    if (i < 0)
+        return;
+    uint32_t line = 0, delta;
+    for (const uint8_t *p = list(i), *end = list_end(i); p < end;) {
+        p = get_varint(p, &delta);
+        line += delta;
+        out->push_back(line);
+    }
+}
+
+void trigram_index::intersect(uint32_t key, std::vector<uint32_t> *lines) const {
+    int i = find(key);
+    if (i < 0) {
+        lines->clear();
+        return;
+    }
+    auto in = lines->begin(), out = lines->begin();
+    uint32_t line = 0, delta;
+    const uint8_t *p = list(i), *end = list_end(i);
+    while (in != lines->end() && p < end) {
+        p = get_varint(p, &delta);
+        line += delta;
+        while (in != lines->end() && *in < line)
+            ++in;
+        if (in != lines->end() && *in == line)
+            *out++ = *in++;
+    }
+    lines->erase(out, lines->end());
+}
@@ -0,0 +1,80 @@
+/********************************************************************
+ * livegrep -- trigram_index.h
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#ifndef CODESEARCH_TRIGRAM_INDEX_H
+#define CODESEARCH_TRIGRAM_INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <vector>
+
+/*
+ * A trigram index: for every three-byte sequence that occurs within a
+ * line of a chunk, the list of the lines it occurs on. It stands in
+ * for a chunk's suffix array at a fraction of the size, but narrows a
+ * search only down to whole lines, and only by the trigrams a plan is
+ * sure to contain.
+ *
+ * Each posting list holds the offsets of the lines' starts, in order,
+ * as varint-encoded deltas from the one before. The index is laid out
+ * as a count of trigrams, their sorted keys, and the offset of each
+ * one's list among the lists that follow, so that it can be written
+ * to and read from an index file in place.
+ */
+class trigram_index {
+public:
+    trigram_index() : enabled_(false), storage_(nullptr), bytes_(0) { }
+
+    static uint32_t key(unsigned char a, unsigned char b, unsigned char c) {
+        return uint32_t(a) << 16 | uint32_t(b) << 8 | c;
+    }
+
+    // Whether the chunk is indexed with trigrams, rather than a suffix
+    // array.
+    void enable() {
+        enabled_ = true;
+    }
+    bool enabled() const {
+        return enabled_;
+    }
+
+    // Builds the index of data[0, size) into storage of our own.
+    void build(const unsigned char *data, uint32_t size);
+    // Uses an index build() left in `storage'.
+    void load(const uint8_t *storage, size_t bytes);
+
+    const uint8_t *storage() const {
+        return storage_;
+    }
+    size_t bytes() const {
+        return bytes_;
+    }
+
+    // Fills `out' with the starts of the lines `key' occurs on.
+    void postings(uint32_t key, std::vector<uint32_t> *out) const;
+    // Keeps only those of `lines', which must be sorted, that `key'
+    // occurs on.
+    void intersect(uint32_t key, std::vector<uint32_t> *lines) const;
+
+private:
+    // The index of `key' among our trigrams, or -1.
+    int find(uint32_t key) const;
+    const uint8_t *list(int i) const;
+    const uint8_t *list_end(int i) const;
+
+    bool enabled_;
+    const uint8_t *storage_;
+    size_t bytes_;
+    uint32_t ntrigrams_;
+    const uint32_t *keys_;
+    const uint32_t *offsets_;
+    const uint8_t *lists_;
+    std::vector<uint8_t> data_;
+};
+
+#endif /* CODESEARCH_TRIGRAM_INDEX_H */
@@ -4,8 +4,23 @@
 
 #include "src/codesearch.h"
 #include "src/content.h"
+#include "src/chunk.h"
+#include "src/chunk_allocator.h"
+#include "src/index_pipeline.h"
+#include "src/query_planner.h"
 #include "src/tools/grpc_server.h"
 
+#include <grpc++/server.h>
+#include <grpc++/server_builder.h>
+
+#include "gflags/gflags.h"
+
+DECLARE_int32(result_cache_mb);
+DECLARE_int32(threads);
+DECLARE_bool(fm_index);
+DECLARE_string(sparse_suffixes);
+DECLARE_bool(trigram_index);
+
 class codesearch_test : public ::testing::Test {
 protected:
     codesearch_test() {
@@ -42,6 +57,49 @@ TEST_F(codesearch_test, IndexTest) {
     EXPECT_EQ(string(file1), content);
 }
 
+TEST_F(codesearch_test, LineIterator) {
+    cs_.index_file(tree_, "/data/file1", file1);
+    cs_.index_file(tree_, "/data/file2", string("dog.\n") + file1);
+    cs_.finalize();
+
+    indexed_file *f = cs_.begin_files()[1].get();
+    EXPECT_GT(7, f->content->size());
+
+    vector<string> lines;
+    for (auto it = f->content->begin_lines(cs_.alloc());
+         it != f->content->end_lines(cs_.alloc()); ++it)
+        lines.push_back(string(it->data(), it->size()));
+    EXPECT_EQ((vector<string>{"dog.", "The quick brown fox", "jumps over the lazy",
+                    "", "", "dog."}), lines);
+
+    auto it = f->content->begin_lines(cs_.alloc(), 4);
+    ASSERT_TRUE(it != f->content->end_lines(cs_.alloc()));
+    EXPECT_EQ("", *it);
+    ++it;
+    EXPECT_EQ("", *it);
+    ++it;
+    EXPECT_EQ("dog.", *it);
+    ++it;
+    EXPECT_TRUE(it == f->content->end_lines(cs_.alloc()));
+    EXPECT_TRUE(f->content->begin_lines(cs_.alloc(), 7) ==
+                f->content->end_lines(cs_.alloc()));
+}
+
+TEST_F(codesearch_test, PrefixBuckets) {
+    cs_.index_file(tree_, "/data/file1", file1);
+    cs_.index_file(tree_, "/data/file2", "a\nab\nb\n\nba\nzz\xff\xff\n");
+    cs_.finalize();
+
+    for (auto it = cs_.alloc()->begin(); it != cs_.alloc()->end(); ++it) {
+        chunk *c = *it;
+        ASSERT_EQ(c->size, c->buckets[kPrefixBuckets - 1]);
+        for (uint32_t k = 0; k + 1 < kPrefixBuckets; k++) {
+            for (uint32_t i = c->buckets[k]; i < c->buckets[k + 1]; i++)
+                ASSERT_EQ(k, c->prefix_key(c->suffixes[i]));
+        }
+    }
+}
+
 TEST_F(codesearch_test, BadRegex) {
     cs_.index_file(tree_, "/data/file1", file1);
     cs_.finalize();
@@ -99,6 +157,41 @@ TEST_F(codesearch_test, DuplicateLinesInFile) {
     EXPECT_EQ(2, matches.results(1).line_number());
 }
 
+TEST_F(codesearch_test, LineNumbersInSharedLines) {
+    string body;
+    for (int i = 0; i < 2000; i++)
+        body += "line " + std::to_string(i) + "\n";
+
+    cs_.index_file(tree_, "/data/file1", body + "needle\n");
+    cs_.index_file(tree_, "/data/file2", "needle\n" + body + "needle\n");
+    cs_.finalize();
+
+    std::unique_ptr<CodeSearch::Service> srv(build_grpc_server(&cs_, nullptr, nullptr));
+    Query request;
+    CodeSearchResult matches;
+    request.set_line("needle");
+    request.set_context_lines(1);
+
+    grpc::ServerContext ctx;
+
+    grpc::Status st = srv->Search(&ctx, &request, &matches);
+    ASSERT_TRUE(st.ok());
+
+    ASSERT_EQ(3, matches.results_size());
+    std::vector<std::pair<string, int>> got;
+    for (auto &r : matches.results()) {
+        got.push_back(std::make_pair(r.path(), int(r.line_number())));
+        if (r.line_number() > 1) {
+            ASSERT_EQ(1, r.context_before_size());
+            EXPECT_EQ("line 1999", r.context_before(0));
+        }
+    }
+    std::sort(got.begin(), got.end());
+    EXPECT_EQ(std::make_pair(string("/data/file1"), 2001), got[0]);
+    EXPECT_EQ(std::make_pair(string("/data/file2"), 1), got[1]);
+    EXPECT_EQ(std::make_pair(string("/data/file2"), 2002), got[2]);
+}
+
 TEST_F(codesearch_test, LongLines) {
     string xs = "x";
     for (int i = 0; i < 10; i++)
@@ -279,6 +372,51 @@ TEST_F(codesearch_test, MaxMatches) {
     }
 }
 
+TEST_F(codesearch_test, SplitChunkSearch) {
+    // One chunk, with candidates spread over more than enough of it to
+    // be split between the executor's workers. Every match line holds
+    // several candidates, so a group boundary inside a line would
+    // report it twice.
+    set<string> want;
+    for (int f = 0; f < 100; f++) {
+        string path = "/file" + std::to_string(f), body;
+        for (int l = 1; l <= 1000; l++) {
+            string n = std::to_string(f * 1000 + l);
+            if (l % 20 == 0) {
+                body += "needle " + n + " needle needle\n";
+                want.insert(path + ":" + std::to_string(l));
+            } else {
+                body += "haystack " + n + " filler filler filler\n";
+            }
+        }
+        cs_.index_file(tree_, path, body);
+    }
+    cs_.finalize();
+    ASSERT_EQ(1, cs_.alloc()->end() - cs_.alloc()->begin());
+    ASSERT_GT((*cs_.alloc()->begin())->size, 3u << 20);
+    ASSERT_GT(FLAGS_threads, 1);
+
+    // A literal takes the exact path, the regex the ranged one.
+    const char *res[] = {"needle", "needle [0-9]+ needle"};
+    for (auto it = std::begin(res); it != std::end(res); ++it) {
+        query q;
+        q.line_pat.reset(new RE2(*it));
+        q.max_matches = 0;
+        q.filename_only = false;
+        q.context_lines = 0;
+
+        vector<string> got;
+        code_searcher::search_thread search(&cs_);
+        match_stats stats;
+        search.match(q, [&](const match_result *m) {
+                got.push_back(m->file->path + ":" + std::to_string(m->lno));
+            }, [](const file_result *) {}, &stats);
+        EXPECT_EQ(kExitNone, stats.why) << *it;
+        EXPECT_EQ(want.size(), got.size()) << *it;
+        EXPECT_EQ(want, set<string>(got.begin(), got.end())) << *it;
+    }
+}
+
 TEST_F(codesearch_test, LineCaseAndFileCaseAreIndependent) {
     cs_.index_file(tree_, "/file1", "contents");
     cs_.index_file(tree_, "/FILE2", "CONTENTS");
@@ -490,3 +628,776 @@ TEST_F(codesearch_test, BadUTF8) {
     ASSERT_TRUE(st.ok());
     ASSERT_EQ(0, matches.results_size());
 }
+
+TEST_F(codesearch_test, ConcurrentSearches) {
+    for (int i = 0; i < 20; i++) {
+        cs_.index_file(tree_, "/file" + std::to_string(i),
+                       "shared line\n"
+                       "unique " + std::to_string(i) + "\n");
+    }
+    cs_.finalize();
+
+    std::unique_ptr<CodeSearch::Service> srv(build_grpc_server(&cs_, nullptr, nullptr));
+    const int kSearches = 16;
+    std::vector<int> counts(kSearches, -1);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < kSearches; i++) {
+        threads.emplace_back([&, i] {
+            Query request;
+            CodeSearchResult matches;
+            request.set_line(i % 2 ? "shared" : "unique 1\\d");
+            request.set_max_matches(-1);
+            grpc::ServerContext ctx;
+            if (srv->Search(&ctx, &request, &matches).ok())
+                counts[i] = matches.results_size();
+        });
+    }
+    for (auto &t : threads)
+        t.join();
+
+    for (int i = 0; i < kSearches; i++) {
+        EXPECT_EQ(i % 2 ? 20 : 10, counts[i]);
+    }
+}
+
+TEST_F(codesearch_test, StreamSearch) {
+    for (int i = 0; i < 250; i++) {
+        cs_.index_file(tree_, "/file" + std::to_string(i),
+                       "needle " + std::to_string(i) + "\n");
+    }
+    cs_.set_name("stream");
+    cs_.finalize();
+
+    std::unique_ptr<CodeSearch::Service> srv(build_grpc_server(&cs_, nullptr, nullptr));
+    grpc::ServerBuilder builder;
+    builder.RegisterService(srv.get());
+    std::unique_ptr<grpc::Server> server(builder.BuildAndStart());
+    std::unique_ptr<CodeSearch::Stub> stub(
+        CodeSearch::NewStub(server->InProcessChannel(grpc::ChannelArguments())));
+
+    Query request;
+    request.set_line("needle");
+    request.set_max_matches(-1);
+
+    grpc::ClientContext ctx;
+    auto reader = stub->StreamSearch(&ctx, request);
+
+    CodeSearchResult batch;
+    int batches = 0, results = 0;
+    SearchStats stats;
+    while (reader->Read(&batch)) {
+        batches++;
+        results += batch.results_size();
+        EXPECT_EQ("stream", batch.index_name());
+        stats = batch.stats();
+    }
+    ASSERT_TRUE(reader->Finish().ok());
+
+    EXPECT_EQ(250, results);
+    EXPECT_GT(batches, 1);
+    EXPECT_EQ(SearchStats::NONE, stats.exit_reason());
+
+    server->Shutdown();
+}
+
+TEST_F(codesearch_test, MaxPendingMatches) {
+    cs_.alloc()->set_chunk_size(1 << 10);
+    for (int i = 0; i < 1000; i++) {
+        cs_.index_file(tree_, "/file" + std::to_string(i),
+                       "pending " + std::to_string(i) + "\n");
+    }
+    cs_.finalize();
+    ASSERT_GT(cs_.alloc()->end() - cs_.alloc()->begin(), 4);
+
+    query q;
+    q.line_pat.reset(new RE2("pending"));
+    q.max_matches = 0;
+    q.filename_only = false;
+    q.context_lines = 0;
+    q.max_pending = 1;
+
+    // A consumer stuck on its first match must not hold up other
+    // searches: the chunk tasks behind it park rather than wait, and
+    // leave the executor free for the search it runs meanwhile.
+    query other = q;
+    other.line_pat.reset(new RE2("pending 99\\b"));
+    other.max_pending = 0;
+    int matches = 0, other_matches = 0;
+    auto fcb = [](const file_result *) {};
+    auto cb = [&](const match_result *) {
+        if (matches++)
+            return;
+        code_searcher::search_thread nested(&cs_);
+        match_stats stats;
+        nested.match(other, [&](const match_result *) { other_matches++; },
+                     fcb, &stats);
+    };
+    code_searcher::search_thread search(&cs_);
+    match_stats stats;
+    search.match(q, cb, fcb, &stats);
+    EXPECT_EQ(kExitNone, stats.why);
+    EXPECT_EQ(1000, matches);
+    EXPECT_EQ(1, other_matches);
+}
+
+TEST_F(codesearch_test, ResultCache) {
+    cs_.index_file(tree_, "/file1", "needle 1\nneedle 2\n");
+    cs_.index_file(tree_, "/file2", "needle 3\n");
+    cs_.finalize();
+
+    FLAGS_result_cache_mb = 1;
+    std::unique_ptr<CodeSearch::Service> srv(build_grpc_server(&cs_, nullptr, nullptr));
+    FLAGS_result_cache_mb = 0;
+
+    Query request;
+    request.set_line("needle");
+    request.set_max_matches(-1);
+
+    CodeSearchResult first, second, limited;
+    grpc::ServerContext ctx;
+    ASSERT_TRUE(srv->Search(&ctx, &request, &first).ok());
+    ASSERT_EQ(3, first.results_size());
+
+    // A different time limit does not change the answer.
+    request.set_timeout_ms(5000);
+    ASSERT_TRUE(srv->Search(&ctx, &request, &second).ok());
+    // A hit reports its own time, not that of the search it repeats.
+    EXPECT_EQ(0, second.stats().re2_time());
+    EXPECT_EQ(0, second.stats().index_time());
+    EXPECT_EQ(0, second.stats().analyze_time());
+    EXPECT_EQ(first.stats().exit_reason(), second.stats().exit_reason());
+    first.clear_stats();
+    second.clear_stats();
+    EXPECT_EQ(first.SerializeAsString(), second.SerializeAsString());
+
+    // A different match limit does.
+    request.set_max_matches(1);
+    ASSERT_TRUE(srv->Search(&ctx, &request, &limited).ok());
+    EXPECT_EQ(1, limited.results_size());
+}
+
+TEST_F(codesearch_test, RefineCandidates) {
+    cs_.index_file(tree_, "/file1", "needle 1\nNeedle 12\nhaystack\n");
+    cs_.index_file(tree_, "/file2", "needle 2\nneedle 1\n");
+    cs_.finalize();
+
+    RE2::Options opts;
+    default_re2_options(opts);
+    opts.set_case_sensitive(false);
+
+    query q;
+    q.max_matches = 0;
+    q.filename_only = false;
+    q.context_lines = 0;
+
+    vector<string> lines;
+    auto cb = [&](const match_result *m) {
+        lines.push_back(m->file->path + ":" + std::to_string(m->lno));
+    };
+    auto fcb = [](const file_result *) {};
+    code_searcher::search_thread search(&cs_);
+    match_stats stats;
+
+    q.line_pat.reset(new RE2("needle", opts));
+    auto set = candidate_set::for_pattern(*q.line_pat);
+    ASSERT_TRUE(set != nullptr);
+    q.record = set;
+    search.match(q, cb, fcb, &stats);
+    EXPECT_EQ(4, lines.size());
+
+    EXPECT_TRUE(set->refined_by(RE2("NEEDLE 1", opts)));
+    EXPECT_TRUE(set->refined_by(RE2("a needle")));
+    EXPECT_FALSE(set->refined_by(RE2("needl", opts)));
+    EXPECT_FALSE(set->refined_by(RE2("needle.1", opts)));
+    EXPECT_FALSE(candidate_set::for_pattern(RE2("needle\\d")));
+    EXPECT_TRUE(set->refined_by(RE2("needle")));
+
+    q.record.reset();
+    q.line_pat.reset(new RE2("needle 1", opts));
+    lines.clear();
+    search.match(q, cb, fcb, &stats);
+    std::sort(lines.begin(), lines.end());
+    vector<string> want = lines;
+    EXPECT_EQ(3, want.size());
+
+    q.refine = set;
+    lines.clear();
+    search.match(q, cb, fcb, &stats);
+    std::sort(lines.begin(), lines.end());
+    EXPECT_EQ(want, lines);
+
+    // A case-sensitive set cannot stand in for a case-insensitive search.
+    auto exact = candidate_set::for_pattern(RE2("needle"));
+    EXPECT_TRUE(exact->refined_by(RE2("needle 1")));
+    EXPECT_FALSE(exact->refined_by(RE2("needle 1", opts)));
+}
+
+TEST_F(codesearch_test, LiteralFastPath) {
+    for (int i = 0; i < 200; i++) {
+        string body = "filler line number " + std::to_string(i) + "\n";
+        if (i % 50 == 0)
+            body += "a needle, another needle\nneedl\n";
+        cs_.index_file(tree_, "/file" + std::to_string(i), body);
+    }
+    cs_.index_file(tree_, "/other", "needle\n");
+    cs_.finalize();
+
+    query q;
+    q.max_matches = 0;
+    q.filename_only = false;
+    q.context_lines = 0;
+
+    vector<string> lines;
+    auto cb = [&](const match_result *m) {
+        lines.push_back(m->file->path + ":" + std::to_string(m->lno) + ":" +
+                        std::to_string(m->matchleft) + "-" +
+                        std::to_string(m->matchright));
+    };
+    auto fcb = [](const file_result *) {};
+    code_searcher::search_thread search(&cs_);
+
+    auto run = [&](const string &pat, match_stats *stats) {
+        lines.clear();
+        q.line_pat.reset(new RE2(pat));
+        search.match(q, cb, fcb, stats);
+        std::sort(lines.begin(), lines.end());
+        return lines;
+    };
+
+    match_stats literal, regex;
+    vector<string> got = run("needle", &literal);
+    EXPECT_EQ(run("needl[e]", &regex), got);
+    EXPECT_EQ(5, got.size());
+    EXPECT_EQ("/file0:2:2-8", got[0]);
+    EXPECT_EQ(0, literal.re2_time.tv_sec);
+    EXPECT_EQ(0, literal.re2_time.tv_usec);
+
+    q.file_pats.emplace_back(new RE2("other"));
+    got = run("needle", &literal);
+    EXPECT_EQ(run("needl[e]", &regex), got);
+    EXPECT_EQ((vector<string>{"/other:1:0-6"}), got);
+}
+
+TEST_F(codesearch_test, WideAlternation) {
+    vector<string> words = {
+        "alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf",
+        "hotel", "india", "juliet", "kilo", "lima", "mike", "november",
+        "oscar", "papa", "quebec", "romeo", "sierra", "tango", "uniform",
+        "victor", "whiskey", "xray", "yankee", "zulu"};
+    string alternation;
+    for (int i = 0; i < 300; i++) {
+        string body = "filler " + std::to_string(i) + "\n";
+        if (i % 10 == 0)
+            body += "call " + words[i / 10 % words.size()] + "()\n";
+        cs_.index_file(tree_, "/file" + std::to_string(i), body);
+    }
+    cs_.finalize();
+    for (auto it = words.begin(); it != words.end(); ++it)
+        alternation += (alternation.empty() ? "" : "|") + *it;
+
+    RE2::Options opts;
+    default_re2_options(opts);
+    opts.set_case_sensitive(false);
+
+    query q;
+    q.line_pat.reset(new RE2("(" + alternation + ")", opts));
+    q.max_matches = 0;
+    q.filename_only = false;
+    q.context_lines = 0;
+
+    ASSERT_TRUE(constructQueryPlan(*q.line_pat));
+
+    int matches = 0;
+    code_searcher::search_thread search(&cs_);
+    match_stats stats;
+    search.match(q, [&](const match_result *) { matches++; },
+                 [](const file_result *) {}, &stats);
+    EXPECT_EQ(30, matches);
+}
+
+TEST_F(codesearch_test, ConjunctivePlan) {
+    for (int i = 0; i < 300; i++) {
+        string body = "common foo " + std::to_string(i) + "\n" +
+            "common bar " + std::to_string(i) + "\n";
+        if (i % 100 == 0)
+            body += "foo then bar " + std::to_string(i) + "\n";
+        cs_.index_file(tree_, "/file" + std::to_string(i), body);
+    }
+    cs_.finalize();
+
+    query q;
+    q.line_pat.reset(new RE2("foo.*bar"));
+    q.max_matches = 0;
+    q.filename_only = false;
+    q.context_lines = 0;
+
+    ASSERT_FALSE(constructQueryPlan(*q.line_pat)->conjuncts().empty());
+
+    vector<string> lines;
+    code_searcher::search_thread search(&cs_);
+    match_stats stats;
+    search.match(q, [&](const match_result *m) { lines.push_back(m->file->path); },
+                 [](const file_result *) {}, &stats);
+    std::sort(lines.begin(), lines.end());
+    EXPECT_EQ((vector<string>{"/file0", "/file100", "/file200"}), lines);
+}
+
+TEST_F(codesearch_test, LineStartAnchor) {
+    for (int i = 0; i < 300; i++) {
+        string n = std::to_string(i);
+        cs_.index_file(tree_, "/file" + n,
+                       "static int a" + n + ";\n" +
+                       "  static int b" + n + ";\n" +
+                       "int c" + n + " = static_cast<int>(d);\n");
+    }
+    cs_.finalize();
+
+    chunk *c = *cs_.alloc()->begin();
+    ASSERT_TRUE(c->line_starts);
+    EXPECT_EQ(900, c->nline_starts);
+    for (uint32_t i = 0; i < c->nline_starts; i++) {
+        uint32_t pos = c->line_starts[i];
+        EXPECT_TRUE(pos == 0 || c->data[pos - 1] == '\n');
+        if (i > 0) {
+            EXPECT_TRUE(chunk::lt_suffix(c)(c->line_starts[i - 1], pos));
+        }
+    }
+
+    RE2::Options opts;
+    default_re2_options(opts);
+    query q;
+    q.line_pat.reset(new RE2("^static", opts));
+    q.max_matches = 0;
+    q.filename_only = false;
+    q.context_lines = 0;
+
+    EXPECT_TRUE(constructQueryPlan(*q.line_pat)->anchor & kAnchorLineStart);
+
+    vector<string> lines;
+    code_searcher::search_thread search(&cs_);
+    match_stats stats;
+    search.match(q, [&](const match_result *m) { lines.push_back(string(m->line.data(), m->line.size())); },
+                 [](const file_result *) {}, &stats);
+    EXPECT_EQ(300, lines.size());
+    for (auto it = lines.begin(); it != lines.end(); ++it)
+        EXPECT_EQ(0, it->find("static int a")) << *it;
+}
+
+TEST_F(codesearch_test, FMIndex) {
+    FLAGS_fm_index = true;
+    code_searcher fm;
+    fm.set_alloc(make_mem_allocator());
+    FLAGS_fm_index = false;
+    const indexed_tree *fm_tree = fm.open_tree("repo", "REV0");
+    cs_.alloc()->set_chunk_size(1 << 16);
+    fm.alloc()->set_chunk_size(1 << 16);
+
+    for (int i = 0; i < 300; i++) {
+        string n = std::to_string(i);
+        string body = "static int a" + n + ";\n" +
+            "  import b" + n + " from \"c" + n + "\";\n" +
+            "int c" + n + " = static_cast<int>(d);\n";
+        if (i % 50 == 0)
+            body += "export foo then bar " + n + "\n";
+        cs_.index_file(tree_, "/file" + n, body);
+        fm.index_file(fm_tree, "/file" + n, body);
+    }
+    cs_.finalize();
+    fm.finalize();
+
+    ASSERT_FALSE((*cs_.alloc()->begin())->fm.enabled());
+    ASSERT_TRUE((*fm.alloc()->begin())->fm.enabled());
+    EXPECT_FALSE((*fm.alloc()->begin())->suffixes);
+
+    string path = ::testing::TempDir() + "/fm_index_test.idx";
+    fm.dump_index(path);
+    code_searcher loaded;
+    loaded.load_index(path);
+    ASSERT_TRUE((*loaded.alloc()->begin())->fm.enabled());
+
+    RE2::Options opts;
+    default_re2_options(opts);
+    auto run = [&](code_searcher *searcher, const char *re) {
+        query q;
+        q.line_pat.reset(new RE2(re, opts));
+        q.max_matches = 0;
+        q.filename_only = false;
+        q.context_lines = 0;
+
+        vector<string> lines;
+        code_searcher::search_thread search(searcher);
+        match_stats stats;
+        search.match(q, [&](const match_result *m) {
+                lines.push_back(m->file->path + ":" + string(m->line.data(), m->line.size()));
+            }, [](const file_result *) {}, &stats);
+        std::sort(lines.begin(), lines.end());
+        return lines;
+    };
+
+    const char *res[] = {"static_cast", "a1[0-9];", "foo.*bar", "^static",
+                         "(import|export) ", "c2\\d\";", "int c(12|250) ", "zzz"};
+    for (auto it = std::begin(res); it != std::end(res); ++it) {
+        vector<string> want = run(&cs_, *it);
+        EXPECT_EQ(want, run(&fm, *it)) << *it;
+        EXPECT_EQ(want, run(&loaded, *it)) << *it;
+
+        // Ranges are narrowed further than in the suffix array, though
+        // ^ doesn't narrow them at all.
+        intrusive_ptr<QueryPlan> plan = constructQueryPlan(RE2(*it, opts));
+        long candidates = fm.count_candidates(plan);
+        EXPECT_GE(candidates, long(want.size())) << *it;
+        if (!(plan->anchor & kAnchorLineStart)) {
+            EXPECT_LE(candidates, cs_.count_candidates(plan)) << *it;
+        }
+
+    }
+    unlink(path.c_str());
+}
+
+TEST_F(codesearch_test, SparseSuffixes) {
+    FLAGS_sparse_suffixes = "ident,punct";
+    code_searcher sparse;
+    sparse.set_alloc(make_mem_allocator());
+    FLAGS_sparse_suffixes = "";
+    const indexed_tree *sparse_tree = sparse.open_tree("repo", "REV0");
+    cs_.alloc()->set_chunk_size(1 << 16);
+    sparse.alloc()->set_chunk_size(1 << 16);
+
+    for (int i = 0; i < 300; i++) {
+        string n = std::to_string(i);
+        string body = "static int a" + n + ";\n" +
+            "  import b" + n + " from \"c" + n + "\";\n" +
+            "int c" + n + " = static_cast<int>(d);\n";
+        if (i % 50 == 0)
+            body += "export foo then bar " + n + "\n";
+        cs_.index_file(tree_, "/file" + n, body);
+        sparse.index_file(sparse_tree, "/file" + n, body);
+    }
+    cs_.finalize();
+    sparse.finalize();
+
+    chunk *c = *sparse.alloc()->begin();
+    ASSERT_EQ(kTokenIdent | kTokenPunct, c->sparse);
+    EXPECT_LT(c->nsuffixes, uint32_t(c->size) / 2);
+    for (uint32_t i = 1; i < c->nsuffixes; i++)
+        ASSERT_FALSE(chunk::lt_suffix(c)(c->suffixes[i], c->suffixes[i - 1]));
+    vector<uint32_t> sorted(c->suffixes, c->suffixes + c->nsuffixes);
+    c->finalize(4);
+    EXPECT_EQ(sorted, vector<uint32_t>(c->suffixes, c->suffixes + c->nsuffixes));
+
+    string path = ::testing::TempDir() + "/sparse_suffixes_test.idx";
+    sparse.dump_index(path);
+    code_searcher loaded;
+    loaded.load_index(path);
+    ASSERT_EQ(c->nsuffixes, (*loaded.alloc()->begin())->nsuffixes);
+
+    RE2::Options opts;
+    default_re2_options(opts);
+    auto run = [&](code_searcher *searcher, const char *re) {
+        query q;
+        q.line_pat.reset(new RE2(re, opts));
+        q.max_matches = 0;
+        q.filename_only = false;
+        q.context_lines = 0;
+
+        vector<string> lines;
+        code_searcher::search_thread search(searcher);
+        match_stats stats;
+        search.match(q, [&](const match_result *m) {
+                lines.push_back(m->file->path + ":" + string(m->line.data(), m->line.size()));
+            }, [](const file_result *) {}, &stats);
+        std::sort(lines.begin(), lines.end());
+        return lines;
+    };
+
+    // Plans that only reach a token start a few steps in are searched
+    // from there; those that never do, like "oob", scan the chunk.
+    const char *res[] = {"static_cast<", "a1[0-9];", "foo.*bar", "^static",
+                         "(import|export) ", "c2\\d\";", "int c(12|250) ",
+                         " = static", "oob", "zzz"};
+    for (auto it = std::begin(res); it != std::end(res); ++it) {
+        vector<string> want = run(&cs_, *it);
+        EXPECT_EQ(want, run(&sparse, *it)) << *it;
+        EXPECT_EQ(want, run(&loaded, *it)) << *it;
+    }
+
+    auto candidates = [&](const char *re) {
+        return sparse.count_candidates(constructQueryPlan(RE2(re, opts)));
+    };
+    // Without line starts, ^ finds every "static" token.
+    EXPECT_EQ(600, candidates("^static"));
+    EXPECT_EQ(300, candidates(" = static"));
+    EXPECT_GT(candidates("oob"), c->size);
+    unlink(path.c_str());
+}
+
+TEST(TrigramIndexTest, SpansBlocks) {
+    // More trigrams than build() sorts at once, so that lists are
+    // merged from several blocks.
+    string data;
+    for (int i = 0; data.size() < (6 << 20); i++)
+        data += "int v" + std::to_string(i % 9973) + " = v" + std::to_string(i) + ";\n";
+    const unsigned char *text = reinterpret_cast<const unsigned char*>(data.data());
+    trigram_index index;
+    index.build(text, data.size());
+
+    const char *trigrams[] = {"int", "v99", " = ", "973", "9;\n"};
+    for (auto it = std::begin(trigrams); it != std::end(trigrams); ++it) {
+        string t(*it, 3);
+        vector<uint32_t> want;
+        for (size_t line = 0; line < data.size(); line = data.find('\n', line) + 1) {
+            if (data.substr(line, data.find('\n', line) - line).find(t) != string::npos)
+                want.push_back(line);
+        }
+        vector<uint32_t> got;
+        index.postings(trigram_index::key(t[0], t[1], t[2]), &got);
+        EXPECT_EQ(want, got) << t;
+    }
+}
+
+TEST_F(codesearch_test, TrigramIndex) {
+    FLAGS_trigram_index = true;
+    code_searcher tri;
+    tri.set_alloc(make_mem_allocator());
+    FLAGS_trigram_index = false;
+    const indexed_tree *tri_tree = tri.open_tree("repo", "REV0");
+    cs_.alloc()->set_chunk_size(1 << 16);
+    tri.alloc()->set_chunk_size(1 << 16);
+
+    for (int i = 0; i < 300; i++) {
+        string n = std::to_string(i);
+        string body = "static int a" + n + ";\n" +
+            "  import b" + n + " from \"c" + n + "\";\n" +
+            "int c" + n + " = static_cast<int>(d);\n";
+        if (i % 50 == 0)
+            body += "export foo then bar " + n + "\n";
+        cs_.index_file(tree_, "/file" + n, body);
+        tri.index_file(tri_tree, "/file" + n, body);
+    }
+    cs_.finalize();
+    tri.finalize();
+
+    const chunk *c = *tri.alloc()->begin();
+    ASSERT_TRUE(c->trigrams.enabled());
+    EXPECT_FALSE(c->suffixes);
+    EXPECT_LT(c->trigrams.bytes(), size_t(c->size) * 2);
+
+    vector<uint32_t> lines;
+    c->trigrams.postings(trigram_index::key('f', 'o', 'o'), &lines);
+    ASSERT_EQ(6, lines.size());
+    for (auto it = lines.begin(); it != lines.end(); ++it)
+        EXPECT_EQ(0, memcmp(c->data + *it, "export foo", 10));
+    c->trigrams.intersect(trigram_index::key('r', ' ', '1'), &lines);
+    EXPECT_EQ(2, lines.size());
+
+    string path = ::testing::TempDir() + "/trigram_index_test.idx";
+    tri.dump_index(path);
+    code_searcher loaded;
+    loaded.load_index(path);
+    ASSERT_TRUE((*loaded.alloc()->begin())->trigrams.enabled());
+    ASSERT_EQ(c->trigrams.bytes(), (*loaded.alloc()->begin())->trigrams.bytes());
+
+    RE2::Options opts;
+    default_re2_options(opts);
+    auto run = [&](code_searcher *searcher, const char *re) {
+        query q;
+        q.line_pat.reset(new RE2(re, opts));
+        q.max_matches = 0;
+        q.filename_only = false;
+        q.context_lines = 0;
+
+        vector<string> lines;
+        code_searcher::search_thread search(searcher);
+        match_stats stats;
+        search.match(q, [&](const match_result *m) {
+                lines.push_back(m->file->path + ":" + string(m->line.data(), m->line.size()));
+            }, [](const file_result *) {}, &stats);
+        std::sort(lines.begin(), lines.end());
+        return lines;
+    };
+
+    const char *res[] = {"static_cast", "a1[0-9];", "foo.*bar", "^static",
+                         "(import|export) ", "c2\\d\";", "int c(12|250) ",
+                         "[a-z]+_cast", "zzz"};
+    for (auto it = std::begin(res); it != std::end(res); ++it) {
+        vector<string> want = run(&cs_, *it);
+        EXPECT_EQ(want, run(&tri, *it)) << *it;
+        EXPECT_EQ(want, run(&loaded, *it)) << *it;
+    }
+
+    // Candidates are whole lines, and only as narrow as their
+    // trigrams: "a111;" holds both of "a11" and "11;".
+    auto candidates = [&](const char *re) {
+        return tri.count_candidates(constructQueryPlan(RE2(re, opts)));
+    };
+    EXPECT_EQ(300, candidates("static_cast"));
+    EXPECT_EQ(11, candidates("a1[0-9];"));
+    EXPECT_EQ(0, candidates("zzz"));
+    EXPECT_GT(candidates("a."), c->size);
+    unlink(path.c_str());
+}
+
+TEST_F(codesearch_test, ParallelSuffixArray) {
+    cs_.alloc()->set_chunk_size(1 << 20);
+    // Enough indentation that the threads sorting divsufsort's
+    // buckets get large, deep ones to share out.
+    for (int i = 0; i < 2000; i++) {
+        string n = std::to_string(i);
+        cs_.index_file(tree_, "/file" + n,
+                       "        if (x" + n + ")\n"
+                       "\t\t\treturn y" + n + ";\n"
+                       "            }\n" + string(i % 40, ' ') + n + "\n");
+    }
+    cs_.finalize();
+
+    chunk *c = *cs_.alloc()->begin();
+    ASSERT_GT(c->buckets[(' ' << 8 | ' ') + 1] - c->buckets[' ' << 8 | ' '], 1u << 16);
+
+    // Newlines sort first, with NULs; a suffix sorts before any suffix
+    // it's a prefix of.
+    vector<unsigned char> munged(c->data, c->data + c->size);
+    std::replace(munged.begin(), munged.end(), '\n', '\0');
+    vector<uint32_t> want(c->size);
+    for (uint32_t i = 0; i < want.size(); i++)
+        want[i] = i;
+    std::sort(want.begin(), want.end(), [&](uint32_t l, uint32_t r) {
+            int cmp = memcmp(&munged[l], &munged[r], c->size - max(l, r));
+            return cmp ? cmp < 0 : l > r;
+        });
+
+    for (int ways = 1; ways <= 4; ways *= 2) {
+        c->finalize(ways);
+        EXPECT_EQ(want, vector<uint32_t>(c->suffixes, c->suffixes + c->size)) << ways;
+    }
+}
+
+TEST_F(codesearch_test, IndexPipeline) {
+    // Sources that share lines, so the index depends on the order
+    // they're committed in.
+    auto read = [](int n, file_sink *sink) {
+        const indexed_tree *tree = sink->open_tree("repo" + std::to_string(n), Metadata(), "REV0");
+        for (int i = 0; i < 200; i++) {
+            string s = std::to_string(i * n);
+            sink->index_file(tree, "/file" + std::to_string(i),
+                             "int x" + s + ";\n" + file1 + s + "\n");
+        }
+    };
+
+    code_searcher want;
+    want.set_alloc(make_mem_allocator());
+    for (int n = 1; n <= 4; n++)
+        read(n, &want);
+    want.finalize();
+
+    code_searcher got;
+    got.set_alloc(make_mem_allocator());
+    index_pipeline pipeline(&got, 3);
+    for (int n = 1; n <= 4; n++)
+        pipeline.add_source([&read, n](file_sink *sink) { read(n, sink); });
+    pipeline.finish();
+    got.finalize();
+
+    auto contents = [](code_searcher *cs, indexed_file *f) {
+        string out;
+        for (auto it = f->content->begin(cs->alloc());
+             it != f->content->end(cs->alloc()); ++it) {
+            out += *it;
+            out += "\n";
+        }
+        return out;
+    };
+    ASSERT_EQ(want.end_files() - want.begin_files(), got.end_files() - got.begin_files());
+    for (auto w = want.begin_files(), g = got.begin_files(); w != want.end_files(); ++w, ++g) {
+        EXPECT_EQ((*w)->path, (*g)->path);
+        EXPECT_EQ((*w)->tree->name, (*g)->tree->name);
+        EXPECT_EQ(contents(&want, w->get()), contents(&got, g->get()));
+    }
+    EXPECT_EQ(want.alloc()->end() - want.alloc()->begin(),
+              got.alloc()->end() - got.alloc()->begin());
+
+    // A source that fails fails the whole pipeline, and stops the
+    // sources still being read.
+    code_searcher failed;
+    failed.set_alloc(make_mem_allocator());
+    {
+        index_pipeline bad(&failed, 2);
+        bad.add_source([](file_sink *) { throw std::runtime_error("unreadable"); });
+        bad.add_source([&read](file_sink *sink) { read(1, sink); });
+        EXPECT_THROW(bad.finish(), std::runtime_error);
+    }
+}
+
+TEST_F(codesearch_test, CancelledSearch) {
+    cs_.index_file(tree_, "/file1", "contents\n");
+    cs_.finalize();
+
+    query q;
+    q.line_pat.reset(new RE2("contents"));
+    q.max_matches = 0;
+    q.filename_only = false;
+    q.context_lines = 0;
+
+    int matches = 0;
+    auto cb = [&](const match_result *) { matches++; };
+    auto fcb = [](const file_result *) {};
+    code_searcher::search_thread search(&cs_);
+
+    {
+        match_stats stats;
+        q.cancelled = [] { return true; };
+        search.match(q, cb, fcb, &stats);
+        EXPECT_EQ(kExitCancelled, stats.why);
+        EXPECT_EQ(0, matches);
+    }
+    {
+        match_stats stats;
+        q.cancelled = nullptr;
+        gettimeofday(&q.deadline, NULL);
+        q.deadline.tv_sec--;
+        search.match(q, cb, fcb, &stats);
+        EXPECT_EQ(kExitTimeout, stats.why);
+        EXPECT_EQ(0, matches);
+    }
+    {
+        match_stats stats;
+        q.deadline = {0, 0};
+        search.match(q, cb, fcb, &stats);
+        EXPECT_EQ(kExitNone, stats.why);
+        EXPECT_EQ(1, matches);
+    }
+}
+
+TEST_F(codesearch_test, RestrictFilesByIndexedPath) {
+    for (int i = 0; i < 50; i++) {
+        cs_.index_file(tree_, "/src/file" + std::to_string(i) + ".c", "contents\n");
+        cs_.index_file(tree_, "/include/file" + std::to_string(i) + ".h", "contents\n");
+    }
+    cs_.finalize();
+
+    std::unique_ptr<CodeSearch::Service> srv(build_grpc_server(&cs_, nullptr, nullptr));
+    struct {
+        std::vector<std::string> file, not_file;
+        int count;
+    } cases[] = {
+        {{"include/"}, {}, 50},
+        {{"src/|include/"}, {}, 100},
+        {{"include/file1"}, {}, 11},
+        {{"INCLUDE/FILE1"}, {}, 0},
+        {{"file1", "\\.c$"}, {}, 11},
+        {{"file4"}, {"include"}, 11},
+        {{"nosuchpath"}, {}, 0},
+    };
+    for (auto &tc : cases) {
+        Query request;
+        CodeSearchResult matches;
+        request.set_line("contents");
+        request.set_max_matches(-1);
+        for (auto &f : tc.file)
+            request.add_file(f);
+        for (auto &f : tc.not_file)
+            request.add_not_file(f);
+        grpc::ServerContext ctx;
+        ASSERT_TRUE(srv->Search(&ctx, &request, &matches).ok());
+        EXPECT_EQ(tc.count, matches.results_size()) << request.DebugString();
+    }
+}
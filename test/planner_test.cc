@@ -5,6 +5,9 @@
 
 #include "src/codesearch.h"
 #include "src/query_planner.h"
+#include "src/query_cache.h"
+#include "src/literal_filter.h"
+#include "src/corpus_stats.h"
 #include "src/lib/debug.h"
 
 TEST(QueryPlanTest, BasicCaseFold) {
@@ -97,3 +100,198 @@ TEST(QueryPlanTest, StressTest) {
         EXPECT_TRUE(key) << "could not compute key for: " << pat;
     }
 }
+
+TEST(QueryPlanTest, WideAlternation) {
+    re2::RE2::Options opts;
+    default_re2_options(opts);
+    opts.set_case_sensitive(false);
+
+    re2::RE2 re("(onCreate|onDestroy|onPause|onResume|onStart|onStop|"
+                "getView|setView|bindView|handleIntent|queryItems|"
+                "updateItems|deleteItems|loadData|saveData|zoomIn|zoomOut|"
+                "xmlParse|jsonParse|yieldTo|waitFor|notifyAll|"
+                "killProcess|execute|finalize|run)", opts);
+    intrusive_ptr<QueryPlan> key = constructQueryPlan(re);
+    ASSERT_TRUE(key);
+    EXPECT_FALSE(key->empty());
+    EXPECT_GT(key->branches().size(), 1);
+    for (auto it = key->branches().begin(); it != key->branches().end(); ++it) {
+        EXPECT_FALSE((*it)->empty());
+        EXPECT_TRUE((*it)->branches().empty());
+    }
+}
+
+TEST(QueryPlanTest, Conjunction) {
+    re2::RE2::Options opts;
+    default_re2_options(opts);
+
+    re2::RE2 re("Deprecated\\(.*timeout", opts);
+    intrusive_ptr<QueryPlan> key = constructQueryPlan(re);
+    ASSERT_TRUE(key);
+    ASSERT_EQ(2, key->conjuncts().size());
+    // The longer literal is the more selective, so it comes first.
+    EXPECT_GT(key->conjuncts()[0]->depth(), key->conjuncts()[1]->depth());
+    EXPECT_LT(key->selectivity(), key->conjuncts()[0]->selectivity());
+
+    // A side too weak to index on its own isn't worth intersecting.
+    re2::RE2 weak("Deprecated.*[a-z]", opts);
+    key = constructQueryPlan(weak);
+    ASSERT_TRUE(key);
+    EXPECT_TRUE(key->conjuncts().empty());
+}
+
+// A ^ carries over to whichever piece of the plan -- the plan itself or
+// one of its conjuncts -- starts where the ^ did.
+static bool anchored_at_line_start(intrusive_ptr<QueryPlan> key) {
+    if (key->anchor & kAnchorLineStart)
+        return true;
+    for (auto it = key->conjuncts().begin(); it != key->conjuncts().end(); ++it)
+        if ((*it)->anchor & kAnchorLineStart)
+            return true;
+    return false;
+}
+
+TEST(QueryPlanTest, LineStart) {
+    re2::RE2::Options opts;
+    default_re2_options(opts);
+
+    const char *anchored[] = {"^func \\w+Handler", "^(import|export) ", "^#include"};
+    for (auto it = std::begin(anchored); it != std::end(anchored); ++it) {
+        re2::RE2 re(*it, opts);
+        intrusive_ptr<QueryPlan> key = constructQueryPlan(re);
+        ASSERT_TRUE(key) << *it;
+        EXPECT_TRUE(anchored_at_line_start(key)) << *it;
+    }
+
+    const char *unanchored[] = {"^\\s*return", "(^|=)import", "^import|export"};
+    for (auto it = std::begin(unanchored); it != std::end(unanchored); ++it) {
+        re2::RE2 re(*it, opts);
+        intrusive_ptr<QueryPlan> key = constructQueryPlan(re);
+        ASSERT_TRUE(key) << *it;
+        EXPECT_FALSE(anchored_at_line_start(key)) << *it;
+    }
+}
+
+TEST(QueryPlanTest, CorpusStats) {
+    re2::RE2::Options opts;
+    default_re2_options(opts);
+
+    std::unique_ptr<corpus_stats> corpus(new corpus_stats);
+    std::string common = "configuration = 1;\n";
+    for (int i = 0; i < 1000; i++)
+        corpus->add((const unsigned char*)common.data(), common.size());
+    std::string rare = "zqj(configuration);\n";
+    corpus->add((const unsigned char*)rare.data(), rare.size());
+    EXPECT_EQ(1001, corpus->lines());
+
+    re2::RE2 re("configuration.*zqj", opts);
+
+    // Without statistics, the longer literal looks more selective...
+    intrusive_ptr<QueryPlan> key = constructQueryPlan(re);
+    ASSERT_TRUE(key);
+    ASSERT_EQ(2, key->conjuncts().size());
+    EXPECT_EQ('c', key->conjuncts()[0]->begin()->first.first);
+
+    // ...but in this corpus it's on every line, and "zqj" is rare; so
+    // rare that intersecting with the other literal isn't worth it.
+    key = constructQueryPlan(re, corpus.get());
+    ASSERT_TRUE(key);
+    EXPECT_TRUE(key->conjuncts().empty());
+    EXPECT_EQ('z', key->begin()->first.first);
+
+    // The cache keeps a plan per corpus, by generation rather than
+    // address, so alternating corpora don't evict each other and a new
+    // corpus is never served another's plan.
+    query_cache cache(1);
+    std::shared_ptr<RE2> cached = cache.compile("configuration.*zqj", opts);
+    intrusive_ptr<QueryPlan> plain = cache.plan(cached);
+    intrusive_ptr<QueryPlan> planned = cache.plan(cached, corpus.get(), 1);
+    EXPECT_EQ(2, plain->conjuncts().size());
+    EXPECT_TRUE(planned->conjuncts().empty());
+    EXPECT_EQ(plain, cache.plan(cached));
+    EXPECT_EQ(planned, cache.plan(cached, corpus.get(), 1));
+
+    corpus_stats fresh;
+    intrusive_ptr<QueryPlan> other = cache.plan(cached, &fresh, 2);
+    EXPECT_NE(planned, other);
+    EXPECT_EQ(2, other->conjuncts().size());
+}
+
+TEST(QueryCacheTest, SharesCompiledPatterns) {
+    query_cache cache(2);
+    re2::RE2::Options opts;
+    re2::RE2::Options folded;
+    folded.set_case_sensitive(false);
+
+    std::shared_ptr<RE2> a = cache.compile("foo.*bar", opts);
+    ASSERT_TRUE(a->ok());
+    EXPECT_EQ(a, cache.compile("foo.*bar", opts));
+    EXPECT_NE(a, cache.compile("foo.*bar", folded));
+    EXPECT_EQ(2, cache.size());
+
+    intrusive_ptr<QueryPlan> plan = cache.plan(a);
+    ASSERT_TRUE(plan);
+    EXPECT_EQ(plan, cache.plan(a));
+
+    // Failed compiles are reported but not kept.
+    EXPECT_FALSE(cache.compile("(", opts)->ok());
+    EXPECT_EQ(2, cache.size());
+
+    // Touching "foo.*bar" above made the folded entry the oldest.
+    std::shared_ptr<RE2> b = cache.compile("baz", opts);
+    EXPECT_EQ(2, cache.size());
+    EXPECT_EQ(a, cache.compile("foo.*bar", opts));
+    EXPECT_EQ(b, cache.compile("baz", opts));
+}
+
+TEST(LiteralFilterTest, RequiredLiterals) {
+    re2::RE2::Options folded;
+    folded.set_case_sensitive(false);
+
+    auto f = literal_filter::for_regex(RE2("\\w+Factory\\("));
+    ASSERT_TRUE(f);
+    EXPECT_EQ(vector<string>{"Factory("}, f->literals());
+    EXPECT_FALSE(f->fold_case());
+
+    f = literal_filter::for_regex(RE2("(foo|barbaz)\\d+x?quux"));
+    ASSERT_TRUE(f);
+    EXPECT_EQ(vector<string>{"quux"}, f->literals());
+
+    f = literal_filter::for_regex(RE2("(foo|barbaz)\\d+"));
+    ASSERT_TRUE(f);
+    EXPECT_EQ((vector<string>{"foo", "barbaz"}), f->literals());
+
+    f = literal_filter::for_regex(RE2("Hello, World", folded));
+    ASSERT_TRUE(f);
+    EXPECT_EQ(vector<string>{"hello, world"}, f->literals());
+    EXPECT_TRUE(f->fold_case());
+
+    EXPECT_FALSE(literal_filter::for_regex(RE2("a.*b")));
+    EXPECT_FALSE(literal_filter::for_regex(RE2("(foo)?bar|x")));
+}
+
+TEST(LiteralFilterTest, Find) {
+    re2::RE2::Options folded;
+    folded.set_case_sensitive(false);
+
+    // Long enough to exercise the vector scans as well as the tail.
+    string text(100, '.');
+    text += "xxfacTORY(yy";
+    text += string(100, '.');
+    text += "zzFactory(";
+
+    auto f = literal_filter::for_regex(RE2("Factory\\("));
+    EXPECT_EQ(text.size() - 8,
+              f->find(text.data(), text.data() + text.size()) - text.data());
+    EXPECT_EQ(text.data() + 200,
+              f->find(text.data(), text.data() + 200));
+
+    f = literal_filter::for_regex(RE2("factory\\(", folded));
+    EXPECT_EQ(102, f->find(text.data(), text.data() + text.size()) - text.data());
+    EXPECT_EQ(text.data() + 109,
+              f->find(text.data(), text.data() + 109));
+
+    f = literal_filter::for_regex(RE2("qq|zzF"));
+    EXPECT_EQ(text.size() - 10,
+              f->find(text.data(), text.data() + text.size()) - text.data());
+}